@@ -21,6 +21,10 @@
 #include <mockdatafeed.hpp>
 #include <marketlevel2data.hpp>
 #include <orderbook.hpp>
+#include <metrics.hpp>
+#include <delimiterscan.hpp>
+#include <pipeline.hpp>
+#include <consolidatedbook.hpp>
 
 BOOST_AUTO_TEST_SUITE(testMarketData)
 
@@ -172,4 +176,773 @@ BOOST_AUTO_TEST_SUITE(testOrderBook)
         BOOST_TEST_MESSAGE( "cycle to process " << i_max << " orders (with getting best bin and ask values) took " << execution_time
                                                 << ".\n");
     }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(testMetrics)
+    BOOST_AUTO_TEST_CASE(testCountersAndSnapshot){
+        OrderBook book;
+        MetricsPublisher metrics;
+        std::vector<std::string> in{
+                {"1568390243|abbb11|a|AAPL|B|209.00000|100"},{"1568390244|abbb12|a|AAPL|S|210.00000|100"},
+                {"1568390245|abbb13|a|MSFT|S|310.00000|100"},{"1568390246|abbb12|u|50"},
+                {"1568390247|abbb14|a|MSFT|S|311.00000|0"}, // size 0 is not processable
+                {"1568390248|abbb11|c"}};
+        for (const auto &s : in) {
+            std::istringstream in_l{s};
+            book.processOrder(MarketData::fromStr(in_l));
+        }
+        BOOST_CHECK_EQUAL(book.getCounters().add, 3);
+        BOOST_CHECK_EQUAL(book.getCounters().update, 1);
+        BOOST_CHECK_EQUAL(book.getCounters().cancel, 1);
+        BOOST_CHECK_EQUAL(book.getCounters().dropped, 1);
+
+        BOOST_CHECK_EQUAL(metrics.generation(), 0);
+        BOOST_CHECK(!metrics.requested());
+        metrics.request();
+        BOOST_CHECK(metrics.requested());
+        metrics.publish(book, {{"raw", 3}, {"orders", 7}});
+        BOOST_CHECK(!metrics.requested());
+        BOOST_CHECK_EQUAL(metrics.generation(), 1);
+
+        auto snapshot = metrics.snapshot();
+        BOOST_REQUIRE_EQUAL(snapshot.queue_depths.size(), 2);
+        BOOST_CHECK_EQUAL(snapshot.queue_depths[1].first, "orders");
+        BOOST_CHECK_EQUAL(snapshot.queue_depths[1].second, 7);
+        BOOST_CHECK_EQUAL(snapshot.live_asks, 2);
+        BOOST_CHECK_EQUAL(snapshot.live_bids, 0);
+        BOOST_CHECK_EQUAL(snapshot.ticker_sizes.size(), 2);
+        BOOST_CHECK_EQUAL(snapshot.ticker_sizes["AAPL"].ask, 1);
+        BOOST_CHECK_EQUAL(snapshot.ticker_sizes["AAPL"].bid, 0);
+        BOOST_CHECK_EQUAL(snapshot.ticker_sizes["MSFT"].ask, 1);
+
+        std::ostringstream prom;
+        writePrometheus(prom, snapshot);
+        BOOST_CHECK(prom.str().find("mop_messages_total{action=\"add\"} 3\n") != std::string::npos);
+        BOOST_CHECK(prom.str().find("mop_messages_dropped_total 1\n") != std::string::npos);
+        BOOST_CHECK(prom.str().find("mop_queue_depth{queue=\"raw\"} 3\n") != std::string::npos);
+        BOOST_CHECK(prom.str().find("mop_queue_depth{queue=\"orders\"} 7\n") != std::string::npos);
+        BOOST_CHECK(prom.str().find("mop_live_orders{side=\"ask\"} 2\n") != std::string::npos);
+        BOOST_CHECK(prom.str().find("mop_ticker_orders{ticker=\"MSFT\",side=\"ask\"} 1\n") != std::string::npos);
+    }
+
+    BOOST_AUTO_TEST_CASE(testRateWindow){
+        OrderBook book;
+        MetricsPublisher metrics(boost::chrono::milliseconds(50));
+        auto add = [&book](int i){
+            std::istringstream in_l{std::to_string(i) + "|id" + std::to_string(i) + "|a|AAPL|S|209.00000|100"};
+            book.processOrder(MarketData::fromStr(in_l));
+        };
+        metrics.publish(book); // opens the first window
+        for (int i = 0; i < 100; ++i) add(i);
+        metrics.publish(book); // a snapshot in the middle of the window doesn't close it
+        BOOST_CHECK_EQUAL(metrics.snapshot().add_rate, 0.);
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        metrics.publish(book);
+        auto rate = metrics.snapshot().add_rate;
+        BOOST_CHECK_GT(rate, 0.);
+        BOOST_CHECK_LE(rate, 100. / 0.05);
+        metrics.publish(book); // right after: same window, same rates
+        BOOST_CHECK_EQUAL(metrics.snapshot().add_rate, rate);
+    }
+
+    BOOST_AUTO_TEST_CASE(testMetricsOverhead){
+        constexpr size_t i_max{200000};
+        MockDataFeed feed;
+        std::vector<boost::shared_ptr<MarketData>> order_pool;
+        for (size_t i = 0; i < i_max; i++){
+            std::istringstream in_l{feed.generateData()};
+            order_pool.push_back(MarketData::fromStr(in_l));
+        }
+        // counters compiled out and no poll, against counters plus the poll of an idle publisher.
+        // Runs are interleaved and the best of each kept, so that allocator warm up doesn't count
+        boost::chrono::microseconds bare{boost::chrono::microseconds::max()}, counted{bare};
+        OrderBook book;
+        MetricsPublisher metrics;
+        for (size_t run = 0; run < 3; ++run) {
+            BasicOrderBook<OrderSet, false> bare_book;
+            auto t1 = boost::chrono::high_resolution_clock::now();
+            for (const auto &md : order_pool) bare_book.processOrder(md);
+            auto t2 = boost::chrono::high_resolution_clock::now();
+            bare = std::min(bare, boost::chrono::duration_cast<boost::chrono::microseconds>(t2-t1));
+            BOOST_CHECK_EQUAL(bare_book.getCounters().add, 0);
+
+            book = OrderBook();
+            t1 = boost::chrono::high_resolution_clock::now();
+            for (const auto &md : order_pool) {
+                if (metrics.requested()) metrics.publish(book);
+                book.processOrder(md);
+            }
+            t2 = boost::chrono::high_resolution_clock::now();
+            counted = std::min(counted, boost::chrono::duration_cast<boost::chrono::microseconds>(t2-t1));
+            BOOST_CHECK_EQUAL(book.askSize(), bare_book.askSize());
+            BOOST_CHECK_EQUAL(book.bidSize(), bare_book.bidSize());
+        }
+        BOOST_CHECK_EQUAL(metrics.generation(), 0);
+        BOOST_TEST_MESSAGE("processing " << i_max << " orders: " << bare << " without metrics, " << counted
+                           << " with idle metrics, overhead "
+                           << static_cast<double>((counted - bare).count()) * 1.e3 / i_max << " ns per order");
+        // one snapshot on the full book
+        metrics.request();
+        auto t1 = boost::chrono::high_resolution_clock::now();
+        if (metrics.requested()) metrics.publish(book);
+        auto t2 = boost::chrono::high_resolution_clock::now();
+        BOOST_CHECK_EQUAL(metrics.generation(), 1);
+        BOOST_CHECK_EQUAL(metrics.snapshot().counters.add + metrics.snapshot().counters.update
+                          + metrics.snapshot().counters.cancel + metrics.snapshot().counters.dropped, i_max);
+        BOOST_TEST_MESSAGE("publishing a snapshot of " << book.askSize() + book.bidSize() << " live orders took "
+                           << boost::chrono::duration_cast<boost::chrono::microseconds>(t2-t1));
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+bool sameMarketData(const MarketData &a, const MarketData &b){
+    double pa{a.getPrice()}, pb{b.getPrice()};
+    return a.getTimestamp() == b.getTimestamp() && a.getOrderId() == b.getOrderId()
+           && a.getAction() == b.getAction() && a.getTicker() == b.getTicker() && a.getSide() == b.getSide()
+           && std::memcmp(&pa, &pb, sizeof(double)) == 0 && a.getSize() == b.getSize()
+           && a.isProcessable() == b.isProcessable();
+}
+
+BOOST_AUTO_TEST_SUITE(testBulkParser)
+    const std::vector<delimiterscan::Isa> all_isa{delimiterscan::Isa::scalar, delimiterscan::Isa::sse2,
+                                                  delimiterscan::Isa::avx2};
+
+    BOOST_AUTO_TEST_CASE(testScannersAgree){
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> byte_gen(0, 7);
+        const std::string alphabet{"|\n0a.S|"};
+        std::string buffer;
+        for (size_t i = 0; i < 4099; ++i) buffer.push_back(alphabet[byte_gen(rng)]);
+        for (size_t offset : {0, 1, 7, 31}) {
+            for (size_t len : {0, 5, 16, 33, 64, 1000, 4000}) {
+                std::vector<std::uint32_t> expected;
+                delimiterscan::scanScalar(buffer.data() + offset, len, expected);
+                for (auto isa : all_isa) {
+                    std::vector<std::uint32_t> found;
+                    delimiterscan::scan(buffer.data() + offset, len, found, isa);
+                    BOOST_CHECK(found == expected);
+                }
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(testFuzzedCorpus){
+        MockDataFeed feed;
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> mutation_gen(0, 9);
+        const std::string alphabet{"0123456789|.acuSB +-xe"};
+        std::uniform_int_distribution<size_t> char_gen(0, alphabet.size() - 1);
+        std::vector<std::string> corpus{"", "|", "||", "1|", "1|2|c|", "1|2|c||", "1|2|u|5|6", "1|2|a|T|S|.5|1",
+                                        "1|2|a|T|S|5.|1|", "1|2|a|T||1.25|0", "1|2|x|T|B|1.0|3", "1|2|a|T|B|."};
+        for (size_t i = 0; i < 20000; ++i) {
+            auto line = feed.generateData();
+            for (auto m = mutation_gen(rng); m < 3 && !line.empty(); m = mutation_gen(rng)) {
+                std::uniform_int_distribution<size_t> pos_gen(0, line.size() - 1);
+                switch (m) {
+                    case 0: line[pos_gen(rng)] = alphabet[char_gen(rng)]; break;
+                    case 1: line.insert(pos_gen(rng), 1, alphabet[char_gen(rng)]); break;
+                    case 2: line.erase(pos_gen(rng), 1); break;
+                }
+            }
+            corpus.push_back(line);
+        }
+
+        std::string buffer;
+        std::vector<boost::shared_ptr<MarketData>> expected;
+        size_t thrown{0};
+        for (const auto &line : corpus) {
+            boost::shared_ptr<MarketData> reference;
+            try {
+                std::istringstream in{line};
+                reference = MarketData::fromStr(in);
+            } catch (std::logic_error &) { // std::invalid_argument, std::out_of_range
+                thrown++;
+            }
+            for (auto isa : all_isa) {
+                std::vector<MarketData> parsed;
+                BOOST_CHECK_NO_THROW(MarketData::fromBuffer(line.data(), line.size(), parsed, isa));
+                if (line.empty()) {
+                    BOOST_CHECK(parsed.empty());
+                    continue;
+                }
+                BOOST_REQUIRE_EQUAL(parsed.size(), 1);
+                if (reference) {
+                    BOOST_CHECK_MESSAGE(sameMarketData(parsed[0], *reference), "mismatch on '" << line << "'");
+                } else { // fromStr threw
+                    BOOST_CHECK_MESSAGE(!parsed[0].isProcessable(), "'" << line << "' should not be processable");
+                }
+            }
+            if (!line.empty()) {
+                buffer += line + "\n";
+                expected.push_back(reference); // null where fromStr threw
+                if (expected.size() % 100 == 0) buffer += "\n"; // empty lines are skipped
+            }
+        }
+        BOOST_TEST_MESSAGE(corpus.size() << " fuzzed orders, " << thrown << " rejected by the conversions");
+        buffer.pop_back(); // last order without newline
+
+        // the malformed lines are spread across the buffer: each one is reported, the others still parse
+        for (auto isa : all_isa) {
+            std::vector<MarketData> parsed;
+            BOOST_CHECK_EQUAL(MarketData::fromBuffer(buffer.data(), buffer.size(), parsed, isa), expected.size());
+            BOOST_REQUIRE_EQUAL(parsed.size(), expected.size());
+            for (size_t i = 0; i < parsed.size(); ++i) {
+                if (expected[i]) BOOST_CHECK(sameMarketData(parsed[i], *expected[i]));
+                else BOOST_CHECK(!parsed[i].isProcessable());
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(testMalformedLineInTheMiddle){
+        std::string buffer{"1568390243|abbb11|a|AAPL|B|209.00000|100\n"
+                           "1568390244|abbb12|a|AAPL|S|not_a_price|100\n"
+                           "x|abbb13|c\n"
+                           "1568390246|abbb14|a|AAPL|S|210.00000|10"};
+        for (auto isa : all_isa) {
+            std::vector<MarketData> parsed;
+            BOOST_REQUIRE_EQUAL(MarketData::fromBuffer(buffer.data(), buffer.size(), parsed, isa), 4);
+            BOOST_CHECK(parsed[0].isProcessable());
+            BOOST_CHECK_EQUAL(parsed[0].getOrderId(), "abbb11");
+            BOOST_CHECK(!parsed[1].isProcessable());
+            BOOST_CHECK_EQUAL(parsed[1].getOrderId(), "abbb12");
+            BOOST_CHECK(!parsed[2].isProcessable());
+            BOOST_CHECK(parsed[3].isProcessable());
+            BOOST_CHECK_EQUAL(parsed[3].getOrderId(), "abbb14");
+            BOOST_CHECK_EQUAL(parsed[3].getSize(), 10);
+
+            OrderBook book;
+            for (const auto &md : parsed) book.processOrder(md);
+            BOOST_CHECK_EQUAL(book.getCounters().add, 2);
+            BOOST_CHECK_EQUAL(book.getCounters().dropped, 2);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(testThroughput){
+        constexpr size_t i_max{500000};
+        MockDataFeed feed;
+        std::vector<std::string> order_pool;
+        std::string buffer;
+        for (size_t i = 0; i < i_max; ++i) {
+            order_pool.push_back(feed.generateData());
+            buffer += order_pool.back() + "\n";
+        }
+        double gigabytes = static_cast<double>(buffer.size()) / 1.e9;
+
+        auto t1 = boost::chrono::high_resolution_clock::now();
+        for (const auto &o : order_pool) {
+            std::istringstream in_l{o};
+            auto md{MarketData::fromStr(in_l)};
+        }
+        auto t2 = boost::chrono::high_resolution_clock::now();
+        auto seconds = boost::chrono::duration_cast<boost::chrono::duration<double>>(t2-t1).count();
+        BOOST_TEST_MESSAGE("fromStr: " << i_max << " orders in " << seconds << " s, " << gigabytes / seconds << " GB/s");
+
+        for (auto isa : all_isa) {
+            std::vector<MarketData> parsed;
+            parsed.reserve(i_max);
+            t1 = boost::chrono::high_resolution_clock::now();
+            auto n = MarketData::fromBuffer(buffer.data(), buffer.size(), parsed, isa);
+            t2 = boost::chrono::high_resolution_clock::now();
+            BOOST_CHECK_EQUAL(n, i_max);
+            seconds = boost::chrono::duration_cast<boost::chrono::duration<double>>(t2-t1).count();
+            BOOST_TEST_MESSAGE("fromBuffer (isa " << static_cast<int>(isa) << "): " << i_max << " orders in "
+                               << seconds << " s, " << gigabytes / seconds << " GB/s");
+        }
+
+        // the delimiter scan alone: fromBuffer is dominated by the decoding of the fields
+        std::vector<std::uint32_t> expected;
+        delimiterscan::scanScalar(buffer.data(), buffer.size(), expected);
+        for (auto isa : all_isa) {
+            std::vector<std::uint32_t> delimiters;
+            delimiters.reserve(expected.size());
+            t1 = boost::chrono::high_resolution_clock::now();
+            delimiterscan::scan(buffer.data(), buffer.size(), delimiters, isa);
+            t2 = boost::chrono::high_resolution_clock::now();
+            BOOST_CHECK(delimiters == expected);
+            seconds = boost::chrono::duration_cast<boost::chrono::duration<double>>(t2-t1).count();
+            BOOST_TEST_MESSAGE("scan (isa " << static_cast<int>(isa) << "): " << delimiters.size() << " delimiters in "
+                               << seconds << " s, " << gigabytes / seconds << " GB/s");
+        }
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(testCompactOrder)
+    BOOST_AUTO_TEST_CASE(testFixedString){
+        Ticker aapl{"AAPL"};
+        BOOST_CHECK_EQUAL(aapl.str(), "AAPL");
+        BOOST_CHECK_EQUAL(aapl.size(), 4);
+        BOOST_CHECK(Ticker{"AAP"} < aapl);
+        BOOST_CHECK(aapl < Ticker{"AAPLX"});
+        BOOST_CHECK(aapl == Ticker{std::string("AAPL")});
+        BOOST_CHECK_EQUAL(sizeof(Ticker), Ticker::capacity() + 1);
+        BOOST_CHECK(!Ticker::fits("A_VERY_LONG_TICKER"));
+        BOOST_CHECK_THROW(Ticker{"A_VERY_LONG_TICKER"}, std::length_error);
+        BOOST_CHECK_LE(sizeof(Order), 48);
+    }
+
+    BOOST_AUTO_TEST_CASE(testIndexSets){
+        OrderBook book;
+        BasicOrderBook<FullOrderSet> full_book;
+        std::vector<std::string> in{
+                {"1568390243|abbb11|a|AAPL|B|209.00000|100"},{"1568390244|abbb12|a|AAPL|B|210.00000|100"},
+                {"1568390245|abbb13|a|AAPL|S|210.00000|100"},{"1568390246|abbb14|a|AAPL|S|209.00000|100"},
+                {"1568390247|abbb13|u|50"},{"1568390248|abbb12|c"},
+                {"1568390249|abbb15|a|A_VERY_LONG_TICKER|S|1.00000|100"}, // ticker too long for the book
+                {"1568390250|a_very_long_order_id_for_the_book|a|AAPL|S|1.00000|100"}}; // id too long
+        for (const auto &s : in) {
+            std::istringstream in_l{s};
+            auto md = MarketData::fromStr(in_l);
+            book.processOrder(md);
+            full_book.processOrder(md);
+        }
+        for (auto *counters : {&book.getCounters(), &full_book.getCounters()}) {
+            BOOST_CHECK_EQUAL(counters->add, 4);
+            BOOST_CHECK_EQUAL(counters->dropped, 2);
+        }
+        BOOST_CHECK_CLOSE(book.getBestAskAndBid("AAPL").get<0>(), 209.00000, 1e-6);
+        BOOST_CHECK_CLOSE(book.getBestAskAndBid("AAPL").get<1>(), 209.00000, 1e-6);
+        BOOST_CHECK_CLOSE(full_book.getBestAskAndBid("AAPL").get<0>(), 209.00000, 1e-6);
+        BOOST_CHECK_CLOSE(full_book.getBestAskAndBid("AAPL").get<1>(), 209.00000, 1e-6);
+        BOOST_CHECK_EQUAL(book.getBestAskAndBid("A_VERY_LONG_TICKER").get<0>(), 0.);
+        BOOST_CHECK_EQUAL(book.getSizeFor("abbb13"), 50);
+        BOOST_CHECK_EQUAL(book.getSizeFor("abbb14"), 100); // not the first ask id
+        BOOST_CHECK_CLOSE(book.getPriceFor("abbb14"), 209.00000, 1e-6);
+        BOOST_CHECK_CLOSE(book.getPriceFor("abbb13"), 210.00000, 1e-6);
+        BOOST_CHECK_CLOSE(book.getPriceFor("abbb11"), 209.00000, 1e-6); // bid
+        BOOST_CHECK_EQUAL(book.getSizeFor("abbb12"), 0); // cancelled
+        BOOST_CHECK_EQUAL(book.getSizeFor("a_very_long_order_id_for_the_book"), 0);
+        BOOST_CHECK_EQUAL(book.getPriceFor("a_very_long_order_id_for_the_book"), 0.);
+
+        auto footprint = book.getFootprint();
+        auto full_footprint = full_book.getFootprint();
+        BOOST_CHECK_EQUAL(footprint.live_orders, 3);
+        BOOST_CHECK_EQUAL(footprint.bytes_per_order, sizeof(OrderSet::final_node_type));
+        BOOST_CHECK_EQUAL(footprint.total_bytes, sizeof(book) + 5 * footprint.bytes_per_order);
+        BOOST_CHECK_LT(footprint.bytes_per_order, full_footprint.bytes_per_order);
+        BOOST_CHECK_LT(footprint.total_bytes, full_footprint.total_bytes);
+        BOOST_TEST_MESSAGE("bytes per live order: " << footprint.bytes_per_order << " (full index set: "
+                           << full_footprint.bytes_per_order << ")");
+    }
+
+    BOOST_AUTO_TEST_CASE(testUnknownIds){
+        // the add of abbb15 is dropped (ticker too long): its update and cancel must be dropped too
+        std::vector<std::string> in{
+                {"1568390243|abbb11|a|AAPL|S|209.00000|100"},
+                {"1568390244|abbb15|a|A_VERY_LONG_TICKER|S|1.00000|100"},
+                {"1568390245|abbb15|u|50"},{"1568390246|abbb15|c"},
+                {"1568390247|never_added|u|50"},{"1568390248|never_added|c"}};
+        OrderBook book, listened;
+        std::size_t notifications{0};
+        listened.onTopOfBook([&notifications](Ticker const&, MarketData::Side, TopOfBook const&){ notifications++; });
+        for (auto *b : {&book, &listened}) {
+            for (const auto &s : in) {
+                std::istringstream in_l{s};
+                b->processOrder(MarketData::fromStr(in_l));
+            }
+            BOOST_CHECK_EQUAL(b->getCounters().add, 1);
+            BOOST_CHECK_EQUAL(b->getCounters().update, 0);
+            BOOST_CHECK_EQUAL(b->getCounters().cancel, 0);
+            BOOST_CHECK_EQUAL(b->getCounters().dropped, 5);
+            BOOST_CHECK_EQUAL(b->askSize(), 1);
+            BOOST_CHECK_EQUAL(b->getSizeFor("abbb11"), 100);
+        }
+        BOOST_CHECK_EQUAL(notifications, 1); // the add of abbb11 only
+        BOOST_CHECK_EQUAL(listened.getTopOfBook(Ticker{"AAPL"}, MarketData::Side::ask).size, 100);
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(testPipeline)
+    BOOST_AUTO_TEST_CASE(testBoundedQueue){
+        BoundedQueue<std::string> q(3);
+        BOOST_CHECK_EQUAL(q.capacity(), 4);
+        BOOST_CHECK(q.empty());
+        for (int i = 0; i < 4; ++i) BOOST_CHECK(q.tryPush(std::to_string(i)));
+        std::string rejected{"4"};
+        BOOST_CHECK(!q.tryPush(std::move(rejected)));
+        BOOST_CHECK_EQUAL(rejected, "4"); // untouched when full
+        BOOST_CHECK_EQUAL(q.size(), 4);
+        std::string out;
+        for (int i = 0; i < 4; ++i) {
+            BOOST_CHECK(q.tryPop(out));
+            BOOST_CHECK_EQUAL(out, std::to_string(i));
+        }
+        BOOST_CHECK(!q.tryPop(out));
+    }
+
+    BOOST_AUTO_TEST_CASE(testIdleStrategy){
+        BOOST_CHECK(IdleStrategy::fromStr("spin").kind == IdleStrategy::Kind::spin);
+        BOOST_CHECK(IdleStrategy::fromStr("yield").kind == IdleStrategy::Kind::yield);
+        BOOST_CHECK(IdleStrategy::fromStr("sleep").kind == IdleStrategy::Kind::sleep);
+        BOOST_CHECK_EQUAL(IdleStrategy::fromStr("sleep:250").sleep_for.count(), 250);
+        BOOST_CHECK_THROW(IdleStrategy::fromStr("nap"), std::invalid_argument);
+    }
+
+    BOOST_AUTO_TEST_CASE(testStagesTransferInOrder){
+        constexpr std::uint64_t i_max{1000000};
+        BoundedQueue<std::uint64_t> q(1024);
+        std::uint64_t produced{0}, consumed{0};
+        std::atomic<bool> in_order{true};
+        Pipeline pipeline;
+        pipeline.addStage({"producer", -1, IdleStrategy::fromStr("yield")}, [&]{
+            if (produced == i_max) return false;
+            if (!q.tryPush(std::uint64_t{produced})) return false;
+            produced++;
+            return true;
+        });
+        pipeline.addStage({"consumer", 0, IdleStrategy::fromStr("spin")}, [&]{
+            std::uint64_t v;
+            if (!q.tryPop(v)) return false;
+            if (v != consumed) in_order = false;
+            consumed++;
+            return true;
+        });
+        pipeline.start();
+        BOOST_CHECK_THROW(pipeline.addStage({"late"}, []{ return false; }), std::logic_error);
+        while (pipeline.stats()[1].work_steps < i_max) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        pipeline.stop();
+        BOOST_CHECK(!pipeline.running());
+        BOOST_CHECK(in_order);
+        BOOST_CHECK_EQUAL(consumed, i_max);
+
+        auto stats = pipeline.stats();
+        BOOST_REQUIRE_EQUAL(stats.size(), 2);
+        BOOST_CHECK_EQUAL(stats[0].name, "producer");
+        BOOST_CHECK(!stats[0].pinned);
+        BOOST_CHECK_EQUAL(stats[0].work_steps, i_max);
+        BOOST_CHECK_EQUAL(stats[1].work_steps, i_max);
+        for (const auto &s : stats) {
+            BOOST_CHECK_GE(s.utilization, 0.);
+            BOOST_CHECK_LE(s.utilization, 1.);
+            BOOST_CHECK_GT(s.seconds, 0.);
+        }
+        std::ostringstream report;
+        report << stats;
+        BOOST_TEST_MESSAGE(report.str());
+    }
+
+    BOOST_AUTO_TEST_CASE(testIdleUtilization){
+        // a stage that never gets work is idle all the time, whatever its idle strategy
+        for (auto idle : {"spin", "yield", "sleep:100"}) {
+            Pipeline pipeline;
+            pipeline.addStage({"starved", -1, IdleStrategy::fromStr(idle)}, []{ return false; });
+            pipeline.start();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            pipeline.stop();
+            auto stats = pipeline.stats();
+            BOOST_CHECK_EQUAL(stats[0].work_steps, 0);
+            BOOST_CHECK_LT(stats[0].utilization, 0.05);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(testPinning){
+        BOOST_CHECK(!Pipeline::cpuAvailable(-1));
+        BOOST_CHECK(!Pipeline::cpuAvailable(CPU_SETSIZE));
+        int cpu{0};
+        while (!Pipeline::cpuAvailable(cpu)) cpu++;
+        Pipeline pinned;
+        pinned.addStage({"pinned", cpu, IdleStrategy::fromStr("yield")}, []{ return false; });
+        pinned.start();
+        pinned.stop();
+        BOOST_CHECK(pinned.stats()[0].pinned);
+
+        Pipeline unpinnable; // no process can run on cpu CPU_SETSIZE
+        std::atomic<int> steps{0};
+        unpinnable.addStage({"healthy", -1, IdleStrategy::fromStr("yield")}, [&steps]{ steps++; return true; });
+        unpinnable.addStage({"unpinnable", CPU_SETSIZE, IdleStrategy::fromStr("yield")}, []{ return false; });
+        BOOST_CHECK_THROW(unpinnable.start(), std::runtime_error);
+        BOOST_CHECK(!unpinnable.running());
+        BOOST_CHECK_EQUAL(steps, 0); // nothing ran
+        BOOST_CHECK(unpinnable.stats()[1].failed);
+    }
+
+    BOOST_AUTO_TEST_CASE(testQueueSize){
+        BoundedQueue<int> q(4);
+        for (int i = 0; i < 4; ++i) BOOST_CHECK(q.tryPush(int{i}));
+        BOOST_CHECK(!q.tryPush(4));
+        BOOST_CHECK_EQUAL(q.size(), 4);
+        int v;
+        BOOST_CHECK(q.tryPop(v));
+        BOOST_CHECK_EQUAL(q.size(), 3);
+
+        // a third thread reading the size while a producer and a consumer run never sees more than the capacity
+        BoundedQueue<int> shared(64);
+        std::atomic<bool> done{false};
+        std::size_t max_seen{0};
+        std::thread producer([&]{
+            for (int i = 0; i < 100000; ++i) while (!shared.tryPush(int{i})) std::this_thread::yield();
+        });
+        std::thread consumer([&]{
+            int x;
+            for (int i = 0; i < 100000; ++i) while (!shared.tryPop(x)) std::this_thread::yield();
+            done = true;
+        });
+        while (!done) {
+            max_seen = std::max(max_seen, shared.size());
+            std::this_thread::yield();
+        }
+        producer.join();
+        consumer.join();
+        BOOST_CHECK_LE(max_seen, shared.capacity());
+    }
+
+    BOOST_AUTO_TEST_CASE(testFailingStage){
+        std::atomic<int> steps{0}, healthy_steps{0};
+        Pipeline pipeline;
+        pipeline.addStage({"healthy", -1, IdleStrategy::fromStr("yield")}, [&]{ healthy_steps++; return true; });
+        pipeline.addStage({"failing", -1, IdleStrategy::fromStr("yield")}, [&]{
+            if (++steps == 10) throw std::runtime_error("bad message");
+            return true;
+        });
+        pipeline.start();
+        while (!pipeline.stats()[1].failed) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        auto before = healthy_steps.load();
+        while (healthy_steps == before) std::this_thread::sleep_for(std::chrono::milliseconds(1)); // still running
+        BOOST_CHECK_THROW(pipeline.stop(), std::runtime_error);
+        BOOST_CHECK(!pipeline.running());
+        BOOST_CHECK_EQUAL(steps, 10);
+        auto stats = pipeline.stats();
+        BOOST_CHECK(!stats[0].failed);
+        BOOST_CHECK(stats[1].failed);
+        BOOST_CHECK_EQUAL(stats[1].work_steps, 9);
+        BOOST_CHECK_NO_THROW(pipeline.stop()); // reported once
+    }
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(testConsolidatedBook)
+    BOOST_AUTO_TEST_CASE(testTopOfBookNotifications){
+        OrderBook book;
+        std::vector<std::tuple<std::string, MarketData::Side, double, std::uint64_t>> seen;
+        book.onTopOfBook([&seen](Ticker const& t, MarketData::Side side, TopOfBook const& top){
+            seen.emplace_back(t.str(), side, top.price, top.size);
+        });
+        std::vector<std::string> in{
+                {"1568390243|abbb11|a|AAPL|S|209.00000|100"}, // new best ask 209 x 100
+                {"1568390244|abbb12|a|AAPL|S|210.00000|100"}, // behind the best: no notification
+                {"1568390245|abbb13|a|AAPL|S|209.00000|50"}, // best ask 209 x 150
+                {"1568390246|abbb12|u|10"}, // behind the best: no notification
+                {"1568390247|abbb11|u|10"}, // best ask 209 x 60
+                {"1568390248|abbb14|a|AAPL|B|200.00000|5"}, // new best bid 200 x 5
+                {"1568390249|abbb11|c"}, // best ask 209 x 50
+                {"1568390250|abbb13|c"}, // best ask 210 x 10
+                {"1568390251|abbb14|c"}}; // no bid left
+        for (const auto &s : in) {
+            std::istringstream in_l{s};
+            book.processOrder(MarketData::fromStr(in_l));
+        }
+        const auto ask = MarketData::Side::ask, bid = MarketData::Side::bid;
+        decltype(seen) expected{{"AAPL", ask, 209., 100}, {"AAPL", ask, 209., 150}, {"AAPL", ask, 209., 60},
+                                {"AAPL", bid, 200., 5}, {"AAPL", ask, 209., 50}, {"AAPL", ask, 210., 10},
+                                {"AAPL", bid, 0., 0}};
+        BOOST_CHECK(seen == expected);
+    }
+
+    BOOST_AUTO_TEST_CASE(testVenueSelection){
+        const auto ask = MarketData::Side::ask, bid = MarketData::Side::bid;
+        ConsolidatedBook cbook(3);
+        Ticker aapl{"AAPL"};
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").ask.venue, -1);
+        cbook.update(1, aapl, ask, {210., 10});
+        cbook.update(2, aapl, ask, {209., 5});
+        cbook.update(0, aapl, bid, {200., 1});
+        cbook.update(2, aapl, bid, {201., 1});
+        auto q = cbook.getBestAskAndBid("AAPL");
+        BOOST_CHECK_EQUAL(q.ask.venue, 2);
+        BOOST_CHECK_EQUAL(q.ask.price, 209.);
+        BOOST_CHECK_EQUAL(q.ask.size, 5);
+        BOOST_CHECK_EQUAL(q.bid.venue, 2);
+        BOOST_CHECK_EQUAL(q.bid.price, 201.);
+        cbook.update(1, aapl, ask, {209., 7}); // same price, bigger size wins
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").ask.venue, 1);
+        cbook.update(0, aapl, ask, {209., 7}); // same price and size: lowest venue wins
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").ask.venue, 0);
+        cbook.update(2, aapl, bid, {}); // venue 2 has no bids left
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").bid.venue, 0);
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").bid.price, 200.);
+        cbook.update(0, aapl, bid, {});
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").bid.venue, -1);
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").bid.price, 0.);
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("MSFT").ask.price, 0.);
+        BOOST_CHECK_THROW(cbook.update(3, aapl, ask, {1., 1}), std::out_of_range);
+    }
+
+    BOOST_AUTO_TEST_CASE(testLevelSizes){
+        // the sizes kept per price level while a listener is registered agree with a walk of the orders
+        MockDataFeed feed;
+        OrderBook walked, leveled;
+        std::size_t notifications{0};
+        for (std::size_t i = 0; i < 100000; ++i) {
+            std::istringstream in_l{feed.generateData()};
+            auto md = MarketData::fromStr(in_l);
+            walked.processOrder(md);
+            leveled.processOrder(md);
+            if (i == 50000) // registering a listener on a live book takes the existing orders
+                leveled.onTopOfBook([&notifications](Ticker const&, MarketData::Side, TopOfBook const&){ notifications++; });
+        }
+        BOOST_CHECK_GT(notifications, 0);
+        // the price levels count in the footprint: at least one value per level with a live order
+        auto walked_footprint = walked.getFootprint(), leveled_footprint = leveled.getFootprint();
+        BOOST_CHECK_EQUAL(leveled_footprint.live_orders, walked_footprint.live_orders);
+        BOOST_CHECK_GT(leveled_footprint.total_bytes, walked_footprint.total_bytes);
+        BOOST_TEST_MESSAGE("book footprint: " << walked_footprint.total_bytes << " bytes, "
+                           << leveled_footprint.total_bytes << " with the price levels of a listener");
+        for (std::size_t t = 0; t < 2025; ++t) {
+            Ticker ticker{std::to_string(t)};
+            for (auto side : {MarketData::Side::ask, MarketData::Side::bid}) {
+                auto expected = walked.getTopOfBook(ticker, side), got = leveled.getTopOfBook(ticker, side);
+                BOOST_CHECK_EQUAL(got.price, expected.price);
+                BOOST_CHECK_EQUAL(got.size, expected.size);
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(testAttach){
+        const auto ask = MarketData::Side::ask, bid = MarketData::Side::bid;
+        auto process = [](OrderBook &book, std::string const& s){
+            std::istringstream in_l{s};
+            book.processOrder(MarketData::fromStr(in_l));
+        };
+        OrderBook venue0, venue1;
+        process(venue0, "1568390243|abbb11|a|AAPL|S|209.00000|100"); // before the attach
+        ConsolidatedBook cbook(2);
+        cbook.attach(venue0, 0);
+        cbook.attach(venue1, 1);
+        BOOST_CHECK_THROW(cbook.attach(venue1, 2), std::out_of_range);
+        auto q = cbook.getBestAskAndBid("AAPL");
+        BOOST_CHECK_EQUAL(q.ask.venue, 0);
+        BOOST_CHECK_EQUAL(q.ask.price, 209.);
+        BOOST_CHECK_EQUAL(q.ask.size, 100);
+
+        process(venue1, "1568390244|abbb21|a|AAPL|S|208.00000|10");
+        process(venue1, "1568390245|abbb22|a|AAPL|B|200.00000|5");
+        process(venue0, "1568390246|abbb12|a|AAPL|B|201.00000|7");
+        q = cbook.getBestAskAndBid("AAPL");
+        BOOST_CHECK_EQUAL(q.ask.venue, 1);
+        BOOST_CHECK_EQUAL(q.ask.price, 208.);
+        BOOST_CHECK_EQUAL(q.bid.venue, 0);
+        BOOST_CHECK_EQUAL(q.bid.price, 201.);
+        BOOST_CHECK_EQUAL(q.bid.size, 7);
+
+        process(venue1, "1568390247|abbb21|c");
+        process(venue0, "1568390248|abbb12|u|3");
+        q = cbook.getBestAskAndBid("AAPL");
+        BOOST_CHECK_EQUAL(q.ask.venue, 0);
+        BOOST_CHECK_EQUAL(q.ask.price, 209.);
+        BOOST_CHECK_EQUAL(q.bid.venue, 0);
+        BOOST_CHECK_EQUAL(q.bid.size, 3);
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").bid.price, venue0.getTopOfBook(Ticker{"AAPL"}, bid).price);
+        BOOST_CHECK_EQUAL(cbook.getBestAskAndBid("AAPL").ask.size, venue0.getTopOfBook(Ticker{"AAPL"}, ask).size);
+    }
+
+    BOOST_AUTO_TEST_CASE(testConcurrentVenues){
+        constexpr std::size_t venues{4};
+        constexpr std::size_t i_max{200000}; // orders per venue
+        std::vector<std::vector<boost::shared_ptr<MarketData>>> order_pools(venues);
+        for (auto &pool : order_pools) {
+            MockDataFeed feed;
+            for (std::size_t i = 0; i < i_max; ++i) {
+                std::istringstream in_l{feed.generateData()};
+                pool.push_back(MarketData::fromStr(in_l));
+            }
+        }
+
+        std::vector<OrderBook> books(venues);
+        std::vector<std::unique_ptr<BoundedQueue<VenueUpdate>>> queues;
+        std::vector<std::vector<VenueUpdate>> pending(venues);
+        std::vector<std::size_t> next(venues, 0);
+        std::vector<char> done(venues, false); // each entry owned by its venue stage
+        std::atomic<std::size_t> venues_done{0};
+        ConsolidatedBook cbook(venues);
+        std::vector<VenueUpdate> applied;
+        Pipeline pipeline;
+        for (std::size_t v = 0; v < venues; ++v) {
+            queues.push_back(std::make_unique<BoundedQueue<VenueUpdate>>(4096));
+            books[v].onTopOfBook([&pending, v](Ticker const& t, MarketData::Side side, TopOfBook const& top){
+                pending[v].push_back({static_cast<std::uint32_t>(v), t, side, top});
+            });
+            pipeline.addStage({"venue" + std::to_string(v), -1, IdleStrategy::fromStr("yield")}, [&, v]{
+                auto &p = pending[v];
+                std::size_t flushed{0};
+                while (flushed < p.size() && queues[v]->tryPush(std::move(p[flushed]))) flushed++;
+                p.erase(p.begin(), p.begin() + flushed);
+                if (!p.empty()) return flushed > 0;
+                if (next[v] == i_max) {
+                    if (!done[v]) venues_done++; // every update of this venue is in its queue
+                    done[v] = true;
+                    return false;
+                }
+                books[v].processOrder(order_pools[v][next[v]++]);
+                return true;
+            });
+        }
+        pipeline.addStage({"consolidator", -1, IdleStrategy::fromStr("yield")}, [&]{
+            bool worked{false};
+            VenueUpdate u;
+            for (auto &q : queues) {
+                while (q->tryPop(u)) {
+                    cbook.update(u.venue, u.ticker, u.side, u.top);
+                    applied.push_back(u);
+                    worked = true;
+                }
+            }
+            return worked;
+        });
+
+        auto t1 = boost::chrono::high_resolution_clock::now();
+        pipeline.start();
+        while (venues_done < venues) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        // the consolidator applies what it popped before leaving its step
+        while (std::any_of(queues.begin(), queues.end(), [](auto &q){ return !q->empty(); }))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        pipeline.stop();
+        auto t2 = boost::chrono::high_resolution_clock::now();
+        auto seconds = boost::chrono::duration_cast<boost::chrono::duration<double>>(t2-t1).count();
+        std::ostringstream report;
+        report << pipeline.stats();
+        BOOST_TEST_MESSAGE(venues << " venues, " << venues * i_max << " orders and " << applied.size()
+                           << " top of book updates in " << seconds << " s\n" << report.str());
+
+        // the incremental view agrees with a brute force scan of the venue books
+        for (std::size_t t = 0; t < 2025; ++t) {
+            Ticker ticker{std::to_string(t)};
+            auto q = cbook.getBestAskAndBid(ticker);
+            for (auto side : {MarketData::Side::ask, MarketData::Side::bid}) {
+                VenueQuote expected;
+                for (std::size_t v = 0; v < venues; ++v) {
+                    auto top = books[v].getTopOfBook(ticker, side);
+                    if (top.price == 0.) continue;
+                    bool better = expected.venue == -1
+                                  || (side == MarketData::Side::ask ? top.price < expected.price : top.price > expected.price)
+                                  || (top.price == expected.price && top.size > expected.size);
+                    if (better) expected = {top.price, top.size, static_cast<int>(v)};
+                }
+                const auto &got = side == MarketData::Side::ask ? q.ask : q.bid;
+                BOOST_CHECK_EQUAL(got.price, expected.price);
+                BOOST_CHECK_EQUAL(got.size, expected.size);
+                BOOST_CHECK_EQUAL(got.venue, expected.venue);
+            }
+        }
+
+        // replay the updates on one thread: cost of an update and of a query, against asking every venue book
+        ConsolidatedBook replay(venues);
+        t1 = boost::chrono::high_resolution_clock::now();
+        for (const auto &u : applied) replay.update(u.venue, u.ticker, u.side, u.top);
+        t2 = boost::chrono::high_resolution_clock::now();
+        auto update_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(t2-t1).count()
+                         / static_cast<double>(applied.size());
+        std::vector<Ticker> tickers;
+        for (std::size_t t = 0; t < 2025; ++t) tickers.emplace_back(std::to_string(t));
+        double checksum{0.};
+        t1 = boost::chrono::high_resolution_clock::now();
+        for (std::size_t r = 0; r < 100; ++r)
+            for (const auto &t : tickers) checksum += replay.getBestAskAndBid(t).ask.price;
+        t2 = boost::chrono::high_resolution_clock::now();
+        auto query_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(t2-t1).count() / (100. * 2025.);
+        t1 = boost::chrono::high_resolution_clock::now();
+        for (std::size_t r = 0; r < 100; ++r)
+            for (const auto &t : tickers)
+                for (auto &b : books) checksum += b.getTopOfBook(t, MarketData::Side::ask).price;
+        t2 = boost::chrono::high_resolution_clock::now();
+        auto scan_ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(t2-t1).count() / (100. * 2025.);
+        BOOST_TEST_MESSAGE("consolidated update " << update_ns << " ns, consolidated query " << query_ns
+                           << " ns, scanning " << venues << " books " << scan_ns << " ns (checksum " << checksum << ")");
+    }
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
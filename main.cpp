@@ -2,97 +2,201 @@
 #include <mockdatafeed.hpp>
 #include <marketlevel2data.hpp>
 #include <orderbook.hpp>
+#include <metrics.hpp>
+#include <pipeline.hpp>
 #include <fstream>
-#include <queue>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <boost/chrono.hpp>
-#include <omp.h>
 
-#define THREAD_NUM 4
-int main() {
+#define QUEUE_SIZE 4096
 
-    std::queue<boost::shared_ptr<MarketData>> order_queue;
-    bool stop{false};
+/*
+ * usage: mop [--pin feed=0,parse=1,book=2,query=3] [--idle spin|yield|sleep[:us]] [--rate orders_per_second] [metrics_file]
+ */
+int main(int argc, char *argv[]) {
+
+    const std::set<std::string> stages{"feed", "parse", "book", "query"};
+    std::map<std::string, int> pin;
+    IdleStrategy idle;
+    double rate{100.}; // orders per second produced by the feeder
+    std::string metrics_path; // Prometheus text file, refreshed once per second
+    std::string arg;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            arg = argv[i];
+            if ((arg == "--pin" || arg == "--idle" || arg == "--rate") && i + 1 == argc)
+                throw std::invalid_argument("missing value");
+            if (arg == "--pin") {
+                std::istringstream in{argv[++i]};
+                std::string item;
+                while (std::getline(in, item, ',')) {
+                    auto eq = item.find('=');
+                    if (eq == std::string::npos) throw std::invalid_argument("entry not in stage=cpu form: " + item);
+                    auto stage = item.substr(0, eq);
+                    if (!stages.count(stage)) throw std::invalid_argument("unknown stage: " + stage);
+                    auto cpu = std::stoi(item.substr(eq + 1));
+                    if (!Pipeline::cpuAvailable(cpu)) throw std::invalid_argument("cpu not available: " + std::to_string(cpu));
+                    pin[stage] = cpu;
+                }
+            }
+            else if (arg == "--idle") idle = IdleStrategy::fromStr(argv[++i]);
+            else if (arg == "--rate") {
+                rate = std::stod(argv[++i]);
+                if (!(rate >= 1.e-6)) throw std::invalid_argument("must be at least 1e-6"); // also rejects NaN
+            }
+            else metrics_path = arg;
+        }
+    } catch (std::exception &e) {
+        std::cerr << "bad " << arg << ": " << e.what() << std::endl;
+        return 1;
+    }
+    auto cpuFor = [&pin](std::string const& stage){ return pin.count(stage) ? pin[stage] : -1; };
+
+    BoundedQueue<std::string> raw_queue(QUEUE_SIZE);
+    BoundedQueue<boost::shared_ptr<MarketData>> order_queue(QUEUE_SIZE);
+    BoundedQueue<std::string> query_queue(16), answer_queue(16);
     OrderBook book;
-    std::string user_input;
+    MetricsPublisher metrics;
+    std::mutex ticker_mutex;
+    std::string ticker; // written by the interface, read by the query stage
     std::cerr.precision(5);
     std::cerr << std::fixed;
-    omp_set_num_threads(THREAD_NUM); // set number of threads in "parallel" blocks
-#pragma omp parallel default(none) shared(user_input, stop, order_queue, book, std::cout, std::cin, std::cerr)
-    {
-        enum thread{feeder, bookkeeper, inquirer, interface};
-        auto role = (thread)omp_get_thread_num();
 
-        /*
-         *  INTERFACE
-         */
-        if(role == interface)
-        {
-            std::cout << "Please input the ticker name you wish to observe. Print 'exit()' to quit." << std::endl;
-            while(strcmp(user_input.c_str(), "exit()")!=0){
-                std::cin >> user_input;
-//                std::cout << user_input << std::endl;
-            }
-            if(strcmp(user_input.c_str(), "exit()")==0){
-                stop = true;
-                std::cout << "stopping the team" << std::endl;
-#pragma omp cancel parallel
-            }
+    /*
+     * state of the stages, declared before the pipeline so that it outlives the stage threads
+     */
+    MockDataFeed feed;
+    auto feed_interval = boost::chrono::nanoseconds(static_cast<std::int64_t>(1.e9 / rate));
+    auto next_order = boost::chrono::steady_clock::now();
+    std::string pending;
+    std::string raw;
+    std::vector<MarketData> batch;
+    boost::shared_ptr<MarketData> parsed;
+    auto next_query = boost::chrono::steady_clock::now();
+    std::uint64_t dumped_generation{0};
+
+    Pipeline pipeline;
+
+    /*
+     * FEEDER: generates random (but correct) orders at the configured rate
+     */
+    pipeline.addStage({"feed", cpuFor("feed"), idle}, [&]{
+        if (pending.empty()) {
+            if (boost::chrono::steady_clock::now() < next_order) return false;
+            next_order += feed_interval;
+            pending = feed.generateData();
         }
+        if (!raw_queue.tryPush(std::move(pending))) return false; // back pressure: retry at the next step
+        pending.clear();
+        return true;
+    });
 
-            /*
-             * FEEDER
-             */
-        else if(role == feeder){
-            MockDataFeed feed;
-            while (!stop) { // as long as the program runs
-                if (boost::chrono::duration_cast<boost::chrono::milliseconds>
-                            (boost::chrono::system_clock::now().time_since_epoch()).count() % 10 ==
-                    0) { // every 0.01 second
-                    auto d = feed.generateData();
-                    auto ss = std::istringstream{d};
-                    order_queue.push(MarketData::fromStr(ss));
-                    usleep(10); // this ensures 100 orders per second
-                }
-#pragma omp cancellation point parallel
-            }
+    /*
+     * PARSER: a malformed order is passed on as not processable, the book counts it as dropped
+     */
+    pipeline.addStage({"parse", cpuFor("parse"), idle}, [&]{
+        if (!parsed) {
+            if (!raw_queue.tryPop(raw)) return false;
+            batch.clear();
+            if (MarketData::fromBuffer(raw.data(), raw.size(), batch) == 0) return true; // empty line
+            parsed = boost::make_shared<MarketData>(batch.front());
         }
+        if (!order_queue.tryPush(std::move(parsed))) return false;
+        parsed.reset();
+        return true;
+    });
 
-        /*
-         * BOOKKEEPER
-         */
-        else if(role == bookkeeper){
-            while (!stop){
-                if(order_queue.empty()){
-#pragma omp cancellation point parallel
-                    continue;
-                }else{
-                    auto o = order_queue.front();
-                    order_queue.pop();
-                    book.processOrder(o);
-                }
+    /*
+     * BOOKKEEPER: the only stage touching the book, it answers the queries too
+     */
+    pipeline.addStage({"book", cpuFor("book"), idle}, [&]{
+        if (metrics.requested()) metrics.publish(book, {{"raw", raw_queue.size()}, {"orders", order_queue.size()}});
+        bool worked{false};
+        std::string query;
+        if (query_queue.tryPop(query)) {
+            auto values = book.getBestAskAndBid(query);
+            std::ostringstream answer;
+            answer.precision(5);
+            answer << std::fixed << query << " A: " << values.get<0>() << "\t" << "B: " << values.get<1>();
+            answer_queue.tryPush(answer.str());
+            worked = true;
+        }
+        boost::shared_ptr<MarketData> o;
+        if (order_queue.tryPop(o)) {
+            book.processOrder(o);
+            worked = true;
+        }
+        return worked;
+    });
+
+    /*
+     * INQUIRER: asks the best prices for the observed ticker once per second, publishes the metrics
+     */
+    pipeline.addStage({"query", cpuFor("query"), idle}, [&]{
+        bool worked{false};
+        std::string answer;
+        while (answer_queue.tryPop(answer)) {
+            std::cerr << answer << std::endl;
+            worked = true;
+        }
+        if (!metrics_path.empty() && metrics.generation() != dumped_generation) {
+            auto snapshot = metrics.snapshot();
+            std::ofstream out(metrics_path + ".tmp");
+            writePrometheus(out, snapshot);
+            writePrometheus(out, pipeline.stats());
+            out.close();
+            std::rename((metrics_path + ".tmp").c_str(), metrics_path.c_str());
+            dumped_generation = snapshot.generation;
+            worked = true;
+        }
+        if (boost::chrono::steady_clock::now() >= next_query) {
+            next_query += boost::chrono::seconds(1);
+            {
+                std::lock_guard<std::mutex> lock(ticker_mutex);
+                query_queue.tryPush(std::string(ticker));
             }
+            if (!metrics_path.empty()) metrics.request();
+            worked = true;
         }
+        return worked;
+    });
 
-            /*
-             * INQUIRER
-             */
-        else if(role == inquirer) {
-            while (!stop) {
-                if ( (boost::chrono::duration_cast<boost::chrono::milliseconds>
-                              (boost::chrono::system_clock::now().time_since_epoch()).count() % 1000 == 0) ) { // every 1 second
+    try {
+        pipeline.start();
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
 
-                    auto values = book.getBestAskAndBid(user_input);
-                    std::cerr << user_input << " A: " << values.get<0>() << "\t" << "B: " << values.get<1>()
-                              << std::endl;
-                    usleep(1000); // sleep for one millisecond to syncronise the computations/prints
-                } else {
-#pragma omp cancellation point parallel
-                    continue;
-                }
-            }
+    /*
+     *  INTERFACE: reads the ticker name of interest from the standard input and eventually stops the pipeline
+     */
+    std::cout << "Please input the ticker name you wish to observe. Print 'stats' for the book and pipeline health, "
+                 "'exit()' to quit." << std::endl;
+    std::string command;
+    while (std::cin >> command && command != "exit()") {
+        if (command == "stats") {
+            auto generation = metrics.generation();
+            metrics.request();
+            // the book stage publishes within a step, unless it failed
+            for (int ms = 0; ms < 1000 && metrics.generation() == generation; ++ms)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::cout << metrics.snapshot() << "\n" << pipeline.stats() << std::flush;
+            continue;
         }
-        usleep(1000*role); // pretty print
-        std::cout << "[" << role << "] stopping job here.\n";
+        std::lock_guard<std::mutex> lock(ticker_mutex);
+        ticker = command;
+    }
+    std::cout << "stopping the pipeline" << std::endl;
+    try {
+        pipeline.stop();
+    } catch (std::exception &e) {
+        std::cout << pipeline.stats();
+        std::cerr << "a stage failed: " << e.what() << std::endl;
+        return 1;
     }
+    std::cout << pipeline.stats();
     return 0;
-}
\ No newline at end of file
+}
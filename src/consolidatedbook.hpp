@@ -0,0 +1,140 @@
+//Consolidated best bid/offer across the books of several venues.
+//Copyright (C) 2023,  Eric Mandolesi
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#pragma once
+
+#include <orderbook.hpp>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+struct VenueQuote{
+    double price{0.}; // 0 when no venue quotes this side
+    std::uint64_t size{0};
+    int venue{-1};
+};
+
+struct ConsolidatedQuote{
+    VenueQuote ask, bid;
+
+    friend std::ostream &operator<<(std::ostream &os, const ConsolidatedQuote &q) {
+        os << "A: " << q.ask.price << " x " << q.ask.size << " @" << q.ask.venue
+           << "\tB: " << q.bid.price << " x " << q.bid.size << " @" << q.bid.venue;
+        return os;
+    }
+};
+
+/* Keeps, for every ticker and side, the top of book of each venue and a tournament tree over the venues:
+ * a change at one venue replays the matches on its path to the root, O(log(venues)), and the root holds the
+ * consolidated best. Ties on the price go to the biggest size, then to the lowest venue.
+ * Not thread safe: books running in the thread owning the ConsolidatedBook can be attached to it, venues running
+ * in other threads forward their TopOfBook changes through queues (see VenueUpdate) to that thread.
+ */
+class ConsolidatedBook{
+public:
+    explicit ConsolidatedBook(std::size_t venues) : venues_(venues) {
+        if (venues == 0) throw std::invalid_argument("ConsolidatedBook: at least one venue is needed");
+        while (leaves_ < venues) leaves_ <<= 1;
+    }
+
+    [[nodiscard]] std::size_t venues() const { return venues_; }
+
+    /**
+     * single threaded case: make book notify this ConsolidatedBook directly, as the given venue.
+     * Replaces the listener of the book, and takes the current top of book of its tickers, O(n).
+     * The book must not outlive this ConsolidatedBook, unless it is given another listener first.
+     */
+    template<typename Book>
+    void attach(Book &book, std::size_t venue){
+        if (venue >= venues_) throw std::out_of_range("ConsolidatedBook: unknown venue");
+        book.onTopOfBook([this, venue](Ticker const& t, MarketData::Side side, TopOfBook const& top){
+            update(venue, t, side, top);
+        });
+        for (const auto &ticker_size : book.getTickerSizes()) {
+            Ticker ticker{ticker_size.first};
+            update(venue, ticker, MarketData::Side::ask, book.getTopOfBook(ticker, MarketData::Side::ask));
+            update(venue, ticker, MarketData::Side::bid, book.getTopOfBook(ticker, MarketData::Side::bid));
+        }
+    }
+
+    // O(log(venues)), plus a hash lookup
+    void update(std::size_t venue, Ticker const& ticker, MarketData::Side side, TopOfBook const& top){
+        if (venue >= venues_) throw std::out_of_range("ConsolidatedBook: unknown venue");
+        auto it = tickers_.find(ticker);
+        if (it == tickers_.end()) it = tickers_.emplace(ticker, Entry(leaves_)).first;
+        auto &tree = side == MarketData::Side::ask ? it->second.ask : it->second.bid;
+        tree.tops[venue] = top;
+        auto node = leaves_ + venue;
+        while (node > 1) {
+            node >>= 1;
+            auto left = tree.winners[2 * node], right = tree.winners[2 * node + 1];
+            tree.winners[node] = better(side, tree.tops, left, right) ? left : right;
+        }
+        auto &best = side == MarketData::Side::ask ? it->second.quote.ask : it->second.quote.bid;
+        auto winner = tree.winners[1];
+        const auto &winning = tree.tops[winner];
+        best = winning.price == 0. ? VenueQuote{} : VenueQuote{winning.price, winning.size, static_cast<int>(winner)};
+    }
+
+    // O(1): a hash lookup
+    [[nodiscard]] ConsolidatedQuote getBestAskAndBid(Ticker const& ticker) const {
+        auto it = tickers_.find(ticker);
+        return it == tickers_.end() ? ConsolidatedQuote{} : it->second.quote;
+    }
+
+    [[nodiscard]] ConsolidatedQuote getBestAskAndBid(std::string const& ticker) const {
+        if (!Ticker::fits(ticker)) return {};
+        return getBestAskAndBid(Ticker{ticker});
+    }
+
+private:
+    struct SideTree{
+        explicit SideTree(std::size_t leaves) : tops(leaves), winners(2 * leaves) {
+            for (std::size_t i = 0; i < leaves; ++i) winners[leaves + i] = static_cast<std::uint32_t>(i);
+            for (std::size_t node = leaves - 1; node > 0; --node) winners[node] = winners[2 * node];
+        }
+        std::vector<TopOfBook> tops; // one per venue, padded to a power of two with empty ones
+        std::vector<std::uint32_t> winners; // winners[1] is the best venue, leaves start at winners[leaves]
+    };
+
+    struct Entry{
+        explicit Entry(std::size_t leaves) : ask(leaves), bid(leaves) {}
+        SideTree ask, bid;
+        ConsolidatedQuote quote;
+    };
+
+    // true if venue a beats venue b on this side
+    static bool better(MarketData::Side side, std::vector<TopOfBook> const& tops, std::uint32_t a, std::uint32_t b){
+        const auto &x = tops[a], &y = tops[b];
+        if (x.price == 0. || y.price == 0.) return y.price == 0. && (x.price != 0. || a < b); // empty sides lose
+        if (x.price != y.price) return side == MarketData::Side::ask ? x.price < y.price : x.price > y.price;
+        if (x.size != y.size) return x.size > y.size;
+        return a < b;
+    }
+
+    std::size_t venues_;
+    std::size_t leaves_{1};
+    std::unordered_map<Ticker, Entry> tickers_;
+};
+
+/* a TopOfBook change of one venue, as carried from the venue thread to the ConsolidatedBook owner */
+struct VenueUpdate{
+    std::uint32_t venue{0};
+    Ticker ticker;
+    MarketData::Side side{MarketData::Side::ask};
+    TopOfBook top;
+};
@@ -0,0 +1,102 @@
+//Vectorised search of the field/message delimiters in a buffer of orders.
+//Copyright (C) 2023,  Eric Mandolesi
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOP_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Each scanner appends to out the offset of every '|' and '\n' in [data, data+len), in increasing order.
+ * Offsets are relative to data: callers scan blocks smaller than 4 GiB.
+ */
+namespace delimiterscan {
+
+    enum class Isa{scalar, sse2, avx2};
+
+    inline void scanScalar(const char *data, std::size_t len, std::vector<std::uint32_t> &out){
+        for (std::size_t i = 0; i < len; ++i) {
+            if (data[i] == '|' || data[i] == '\n') out.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+
+#ifdef MOP_X86_SIMD
+    // turn a bitmask of matches starting at offset base into offsets
+    inline void appendMask(std::uint32_t mask, std::size_t base, std::vector<std::uint32_t> &out){
+        while (mask) {
+            out.push_back(static_cast<std::uint32_t>(base + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+    // SSE2 is part of the x86-64 baseline: no target attribute needed
+    inline void scanSse2(const char *data, std::size_t len, std::vector<std::uint32_t> &out){
+        const __m128i pipe = _mm_set1_epi8('|');
+        const __m128i newline = _mm_set1_epi8('\n');
+        std::size_t i = 0;
+        for (; i + 16 <= len; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            __m128i match = _mm_or_si128(_mm_cmpeq_epi8(block, pipe), _mm_cmpeq_epi8(block, newline));
+            appendMask(static_cast<std::uint32_t>(_mm_movemask_epi8(match)), i, out);
+        }
+        std::size_t tail = out.size();
+        scanScalar(data + i, len - i, out);
+        for (; tail < out.size(); ++tail) out[tail] += static_cast<std::uint32_t>(i);
+    }
+
+    __attribute__((target("avx2")))
+    inline void scanAvx2(const char *data, std::size_t len, std::vector<std::uint32_t> &out){
+        const __m256i pipe = _mm256_set1_epi8('|');
+        const __m256i newline = _mm256_set1_epi8('\n');
+        std::size_t i = 0;
+        for (; i + 32 <= len; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(block, pipe), _mm256_cmpeq_epi8(block, newline));
+            appendMask(static_cast<std::uint32_t>(_mm256_movemask_epi8(match)), i, out);
+        }
+        std::size_t tail = out.size();
+        scanScalar(data + i, len - i, out);
+        for (; tail < out.size(); ++tail) out[tail] += static_cast<std::uint32_t>(i);
+    }
+#endif
+
+    // best instruction set supported by the running cpu
+    inline Isa detectIsa(){
+#ifdef MOP_X86_SIMD
+        static const Isa isa = __builtin_cpu_supports("avx2") ? Isa::avx2 : Isa::sse2;
+        return isa;
+#else
+        return Isa::scalar;
+#endif
+    }
+
+    /**
+     * runtime dispatch to the requested scanner. An Isa not supported by the build/cpu falls back to
+     * the best supported one.
+     */
+    inline void scan(const char *data, std::size_t len, std::vector<std::uint32_t> &out, Isa isa = detectIsa()){
+#ifdef MOP_X86_SIMD
+        if (isa == Isa::avx2 && detectIsa() == Isa::avx2) return scanAvx2(data, len, out);
+        if (isa != Isa::scalar) return scanSse2(data, len, out);
+#endif
+        scanScalar(data, len, out);
+    }
+}
@@ -0,0 +1,71 @@
+//Fixed capacity string stored inline, used for the ids and tickers of the live orders.
+//Copyright (C) 2023,  Eric Mandolesi
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/* Up to N chars plus a length byte, no heap allocation: sizeof(FixedString<N>) == N+1.
+ * Ordered as std::string. Construction is explicit, so that keys are converted once before
+ * a lookup rather than at each comparison.
+ */
+template<std::size_t N>
+class FixedString{
+    static_assert(N < 256, "the length is stored in one byte");
+public:
+    FixedString() = default;
+
+    explicit FixedString(std::string_view s){
+        if (!fits(s)) throw std::length_error("FixedString: '" + std::string(s) + "' exceeds capacity");
+        std::memcpy(data_, s.data(), s.size());
+        size_ = static_cast<std::uint8_t>(s.size());
+    }
+    explicit FixedString(const std::string &s) : FixedString(std::string_view(s)) {}
+    explicit FixedString(const char *s) : FixedString(std::string_view(s)) {}
+
+    static constexpr std::size_t capacity() { return N; }
+    static constexpr bool fits(std::string_view s) { return s.size() <= N; }
+
+    [[nodiscard]] std::size_t size() const { return size_; }
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+    [[nodiscard]] std::string_view view() const { return {data_, size_}; }
+    [[nodiscard]] std::string str() const { return {data_, size_}; }
+
+    friend bool operator<(const FixedString &a, const FixedString &b) { return a.view() < b.view(); }
+    friend bool operator==(const FixedString &a, const FixedString &b) { return a.view() == b.view(); }
+    friend bool operator!=(const FixedString &a, const FixedString &b) { return !(a == b); }
+
+    friend std::ostream &operator<<(std::ostream &os, const FixedString &s) {
+        os << s.view();
+        return os;
+    }
+
+private:
+    char data_[N]{};
+    std::uint8_t size_{0};
+};
+
+namespace std {
+    template<std::size_t N>
+    struct hash<FixedString<N>>{
+        std::size_t operator()(const FixedString<N> &s) const noexcept { return hash<string_view>{}(s.view()); }
+    };
+}
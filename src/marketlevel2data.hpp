@@ -15,8 +15,14 @@
 //Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.#ifndef JIT_MARKETLEVEL2DATA_HPP
 
 #include <string>
+#include <string_view>
 #include <strstream>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
 #include <boost/make_shared.hpp>
+#include <delimiterscan.hpp>
 #pragma once
 
 
@@ -33,7 +39,6 @@ public:
     static boost::shared_ptr<MarketData> fromStr(std::istream & in){
 
         auto result = boost::make_shared<MarketData>(MarketData());
-        enum position{start=0, timestamp=0, orderid=1, action=2, other=3, ticker=3, side=4, price=5, size=6, end=7};
         auto p_i = static_cast<size_t>(position::start);
         std::string token;
         while (std::getline(in,token,'|')){
@@ -76,6 +81,63 @@ public:
         return result;
     }
 
+    /**
+     * bulk counterpart of fromStr for large buffers of '\n' separated orders (replay files, socket reads).
+     * All the delimiters of a block are located at once by a vectorised scanner, then the fields are decoded
+     * straight from the buffer. Every non-empty line gives the same MarketData fromStr gives for it, except
+     * the lines on which fromStr throws (malformed numbers): these give a non-processable MarketData and the
+     * parsing goes on with the next line. Empty lines are skipped.
+     * @param data buffer of orders, the last one may miss its '\n'
+     * @param len buffer size in bytes
+     * @param out the parsed orders are appended here
+     * @param isa delimiter scanner, defaults to the best one supported by the cpu
+     * @return number of orders appended to out
+     */
+    static std::size_t fromBuffer(const char *data, std::size_t len, std::vector<MarketData> &out,
+                                  delimiterscan::Isa isa = delimiterscan::detectIsa()){
+        constexpr std::size_t block_size{1u << 20};
+        std::vector<std::uint32_t> delimiters;
+        std::size_t parsed{0};
+        std::size_t begin{0};
+        while (begin < len) {
+            std::size_t end = std::min(len, begin + block_size);
+            if (end < len) { // stretch the block to the end of its last line
+                auto newline = static_cast<const char *>(std::memchr(data + end, '\n', len - end));
+                end = newline ? static_cast<std::size_t>(newline - data) + 1 : len;
+            }
+            delimiters.clear();
+            delimiterscan::scan(data + begin, end - begin, delimiters, isa);
+            delimiters.push_back(static_cast<std::uint32_t>(end - begin)); // the buffer end closes the last line
+
+            const char *block = data + begin;
+            std::size_t line_start{0}, token_start{0};
+            auto p_i = static_cast<size_t>(position::start);
+            MarketData md;
+            bool malformed{false}; // once a field fails to convert, the rest of the line is ignored
+            for (auto d : delimiters) {
+                std::string_view token{block + token_start, d - token_start};
+                if (d < end - begin && block[d] == '|') {
+                    if (!malformed) malformed = !md.trySetField(p_i, token);
+                } else { // end of line
+                    if (d > line_start) {
+                        // as getline, drop a trailing empty token
+                        if (!token.empty() && !malformed) malformed = !md.trySetField(p_i, token);
+                        if (malformed) md.processable_ = false;
+                        out.push_back(std::move(md));
+                        parsed++;
+                    }
+                    md = MarketData();
+                    malformed = false;
+                    p_i = position::start;
+                    line_start = d + 1;
+                }
+                token_start = d + 1;
+            }
+            begin = end;
+        }
+        return parsed;
+    }
+
     [[nodiscard]] uint64_t getTimestamp() const {
         return timestamp_;
     }
@@ -107,16 +169,106 @@ public:
     [[nodiscard]] bool isProcessable() const { return processable_; }
 
 private:
+    enum position{start=0, timestamp=0, orderid=1, action=2, other=3, ticker=3, side=4, price=5, size=6, end=7};
+
     MarketData() = default;
-    std::uint64_t timestamp_;
+    std::uint64_t timestamp_{0};
     std::string order_id_;
-    Action action_;
+    Action action_{Action::add};
     std::string ticker_;
-    Side side_;
-    double price_;
-    std::uint32_t size_;
+    Side side_{Side::ask};
+    double price_{0.};
+    std::uint32_t size_{0};
     bool processable_{true};
 
+    /* decode token as field p_i, with the same semantics of the switch in fromStr.
+     * Plain numbers are converted in place, anything else goes through the std conversions fromStr uses.
+     */
+    void setField(std::size_t &p_i, std::string_view token){
+        unsigned long long value;
+        switch (p_i) {
+            case position::timestamp:
+                setTimestamp(parseDigits(token, 19, value) ? value : std::stoull(std::string(token)));
+                break;
+            case position::orderid:
+                order_id_.assign(token.data(), token.size());
+                break;
+            case position::action:
+                if(!token.empty() && token[0]=='c'){
+                    setAction(Action::cancel);
+                    p_i = position::size;
+                }
+                if(!token.empty() && token[0]=='u'){
+                    setAction(Action::update);
+                    p_i = position::price;
+                }
+                if(!token.empty() && token[0]=='a')setAction(Action::add);
+                break;
+            case position::ticker:
+                ticker_.assign(token.data(), token.size());
+                break;
+            case position::side:
+                setSide(!token.empty() && token[0]=='S'?Side::ask:Side::bid);
+                break;
+            case position::price:
+            {
+                double price;
+                setPrice(parseDecimal(token, price) ? price : std::stod(std::string(token)));
+                break;
+            }
+            case position::size:
+                processable_= setSize(parseDigits(token, 9, value) ? value : std::stoul(std::string(token)));
+                break;
+            default:
+                processable_=false;
+        }
+        p_i++;
+    }
+
+    // setField reporting the std conversion errors (std::invalid_argument, std::out_of_range) as false
+    bool trySetField(std::size_t &p_i, std::string_view token){
+        try {
+            setField(p_i, token);
+            return true;
+        } catch (std::logic_error &) {
+            return false;
+        }
+    }
+
+    // digits only, at most max_digits of them (so that the value cannot overflow)
+    static bool parseDigits(std::string_view token, std::size_t max_digits, unsigned long long &value){
+        if (token.empty() || token.size() > max_digits) return false;
+        value = 0;
+        for (char c : token) {
+            if (c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    /* digits with at most one '.', at most 15 significant digits. Both the mantissa and the power of ten
+     * are exact doubles, so the division is correctly rounded and matches std::stod bit by bit.
+     */
+    static bool parseDecimal(std::string_view token, double &value){
+        static constexpr double pow10[]{1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+        std::uint64_t mantissa{0};
+        std::size_t digits{0}, decimals{0};
+        bool dot{false};
+        for (char c : token) {
+            if (c == '.' && !dot) {
+                dot = true;
+                continue;
+            }
+            if (c < '0' || c > '9' || ++digits > 15) return false;
+            mantissa = mantissa * 10 + (c - '0');
+            if (dot) decimals++;
+        }
+        if (digits == 0) return false;
+        value = static_cast<double>(mantissa) / pow10[decimals];
+        return true;
+    }
+
     void setTimestamp(const std::uint64_t &timestamp) {
         timestamp_ = timestamp;
     }
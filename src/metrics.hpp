@@ -0,0 +1,174 @@
+//Runtime metrics for the order book and the processing pipeline.
+//Copyright (C) 2023,  Eric Mandolesi
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#pragma once
+
+#include <orderbook.hpp>
+#include <boost/chrono.hpp>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+/* A consistent picture of the book and pipeline health at a given time.
+ * Counters are cumulative, rates are averaged over the last complete aggregation window of the publisher
+ * (0 until the first window is complete).
+ */
+struct StatsSnapshot{
+    std::uint64_t generation{0};
+    std::uint64_t timestamp_ms{0};
+    OrderCounters counters;
+    double add_rate{0.};
+    double update_rate{0.};
+    double cancel_rate{0.};
+    std::vector<std::pair<std::string, std::size_t>> queue_depths; // messages waiting in each named queue
+    std::size_t live_asks{0};
+    std::size_t live_bids{0};
+    BookFootprint footprint;
+    std::map<std::string, TickerSize> ticker_sizes;
+
+    friend std::ostream &operator<<(std::ostream &os, const StatsSnapshot &s) {
+        os << "queue depth:";
+        for (const auto &[queue, depth] : s.queue_depths) os << " " << queue << " " << depth;
+        os << "\nlive orders: ask " << s.live_asks << " bid " << s.live_bids << " tickers " << s.ticker_sizes.size()
+           << "\nbook memory: " << s.footprint.total_bytes << " bytes, " << s.footprint.bytes_per_order << " per order"
+           << "\nmessages: add " << s.counters.add << " update " << s.counters.update
+           << " cancel " << s.counters.cancel << " dropped " << s.counters.dropped
+           << "\nmessages/s: add " << s.add_rate << " update " << s.update_rate << " cancel " << s.cancel_rate;
+        return os;
+    }
+};
+
+/* Write the snapshot in the Prometheus text exposition format */
+inline std::ostream &writePrometheus(std::ostream &os, const StatsSnapshot &s){
+    os << "# TYPE mop_messages_total counter\n"
+       << "mop_messages_total{action=\"add\"} " << s.counters.add << "\n"
+       << "mop_messages_total{action=\"update\"} " << s.counters.update << "\n"
+       << "mop_messages_total{action=\"cancel\"} " << s.counters.cancel << "\n"
+       << "# TYPE mop_messages_dropped_total counter\n"
+       << "mop_messages_dropped_total " << s.counters.dropped << "\n"
+       << "# TYPE mop_messages_per_second gauge\n"
+       << "mop_messages_per_second{action=\"add\"} " << s.add_rate << "\n"
+       << "mop_messages_per_second{action=\"update\"} " << s.update_rate << "\n"
+       << "mop_messages_per_second{action=\"cancel\"} " << s.cancel_rate << "\n"
+       << "# TYPE mop_queue_depth gauge\n";
+    for (const auto &[queue, depth] : s.queue_depths)
+        os << "mop_queue_depth{queue=\"" << queue << "\"} " << depth << "\n";
+    os << "# TYPE mop_live_orders gauge\n"
+       << "mop_live_orders{side=\"ask\"} " << s.live_asks << "\n"
+       << "mop_live_orders{side=\"bid\"} " << s.live_bids << "\n"
+       << "# TYPE mop_book_bytes gauge\n"
+       << "mop_book_bytes " << s.footprint.total_bytes << "\n"
+       << "# TYPE mop_book_bytes_per_order gauge\n"
+       << "mop_book_bytes_per_order " << s.footprint.bytes_per_order << "\n"
+       << "# TYPE mop_ticker_orders gauge\n";
+    for (const auto &[ticker, size] : s.ticker_sizes) {
+        os << "mop_ticker_orders{ticker=\"" << ticker << "\",side=\"ask\"} " << size.ask << "\n"
+           << "mop_ticker_orders{ticker=\"" << ticker << "\",side=\"bid\"} " << size.bid << "\n";
+    }
+    return os;
+}
+
+/* Bridges the thread owning the OrderBook (the writer) and any number of readers.
+ * The writer keeps bumping the plain OrderCounters of the book and only polls a relaxed atomic flag:
+ * the snapshot is built (and the book walked) only when some reader asked for it.
+ * With nobody reading, the overhead on the hot path is one relaxed load per processed message.
+ */
+class MetricsPublisher{
+public:
+    /**
+     * @param rate_window aggregation window of the message rates: the rates of a snapshot do not depend
+     * on how often, or by whom, snapshots are requested
+     */
+    explicit MetricsPublisher(boost::chrono::milliseconds rate_window = boost::chrono::seconds(1))
+            : rate_window_(rate_window) {}
+
+    // reader side: ask the writer for a fresh snapshot
+    void request(){ requested_.store(true, std::memory_order_relaxed); }
+
+    // writer side: cheap check to be called once per processed message
+    [[nodiscard]] bool requested() const { return requested_.load(std::memory_order_relaxed); }
+
+    /**
+     * writer side: build a snapshot from the book and make it visible to readers.
+     * Must be called from the thread driving OrderBook::processOrder.
+     * @param book the book to inspect, any BasicOrderBook
+     * @param queue_depths number of messages waiting in each queue of the pipeline, by queue name
+     */
+    template<typename Book>
+    void publish(Book const& book, std::vector<std::pair<std::string, std::size_t>> queue_depths = {}){
+        requested_.exchange(false, std::memory_order_relaxed); // a request arriving from now on gets the next snapshot
+        StatsSnapshot s;
+        s.timestamp_ms = boost::chrono::duration_cast<boost::chrono::milliseconds>
+                (boost::chrono::system_clock::now().time_since_epoch()).count();
+        s.counters = book.getCounters();
+        s.queue_depths = std::move(queue_depths);
+        s.live_asks = book.askSize();
+        s.live_bids = book.bidSize();
+        s.footprint = book.getFootprint();
+        s.ticker_sizes = book.getTickerSizes();
+        updateRates(s.counters);
+        s.add_rate = add_rate_;
+        s.update_rate = update_rate_;
+        s.cancel_rate = cancel_rate_;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        s.generation = last_.generation + 1;
+        last_ = std::move(s);
+        generation_.store(last_.generation, std::memory_order_release);
+    }
+
+    // reader side: generation of the latest published snapshot, 0 if none
+    [[nodiscard]] std::uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+    // reader side: copy of the latest published snapshot
+    [[nodiscard]] StatsSnapshot snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_;
+    }
+
+private:
+    // writer side: close the current window once it lasted rate_window_ (steady clock, immune to wall clock jumps)
+    void updateRates(OrderCounters const& counters){
+        auto now = boost::chrono::steady_clock::now();
+        if (!window_open_) {
+            window_open_ = true;
+        } else {
+            auto elapsed = now - window_start_;
+            if (elapsed < rate_window_) return;
+            double dt = boost::chrono::duration_cast<boost::chrono::duration<double>>(elapsed).count();
+            add_rate_ = static_cast<double>(counters.add - window_counters_.add) / dt;
+            update_rate_ = static_cast<double>(counters.update - window_counters_.update) / dt;
+            cancel_rate_ = static_cast<double>(counters.cancel - window_counters_.cancel) / dt;
+        }
+        window_start_ = now;
+        window_counters_ = counters;
+    }
+
+    // writer only state
+    boost::chrono::steady_clock::duration rate_window_;
+    bool window_open_{false};
+    boost::chrono::steady_clock::time_point window_start_;
+    OrderCounters window_counters_;
+    double add_rate_{0.}, update_rate_{0.}, cancel_rate_{0.};
+
+    std::atomic<bool> requested_{false};
+    std::atomic<std::uint64_t> generation_{0};
+    mutable std::mutex mutex_;
+    StatsSnapshot last_;
+};
@@ -130,13 +130,13 @@ public:
                         size = size_gen(generator);
                         {std::uniform_int_distribution<int> randomPick(0,ask_ticker_pool.size()-1);
                             retOrder = ask_ticker_pool[randomPick(generator)];
-                            result=std::to_string(ms)+"|"+retOrder.id+"|u|"+ std::to_string(size);
+                            result=std::to_string(ms)+"|"+retOrder.id.str()+"|u|"+ std::to_string(size);
                             break;}
                     case 'B':
                         size = size_gen(generator);
                     {std::uniform_int_distribution<int> randomPick(0,bid_ticker_pool.size()-1);
                         retOrder = bid_ticker_pool[randomPick(generator)];
-                        result=std::to_string(ms)+"|"+retOrder.id+"|u|"+ std::to_string(size);
+                        result=std::to_string(ms)+"|"+retOrder.id.str()+"|u|"+ std::to_string(size);
                         break;}
                 }
                 break;
@@ -147,14 +147,14 @@ public:
                         int rn = randomPick(generator);
                         retOrder = ask_ticker_pool[rn];
                         ask_ticker_pool.erase(ask_ticker_pool.begin()+rn);
-                        result=std::to_string(ms)+"|"+retOrder.id+"|c";
+                        result=std::to_string(ms)+"|"+retOrder.id.str()+"|c";
                         break;}
                     case 'B':
                     {std::uniform_int_distribution<int> randomPick(0,bid_ticker_pool.size()-1);
                         int rn = randomPick(generator);
                         retOrder = bid_ticker_pool[rn];
                         bid_ticker_pool.erase(bid_ticker_pool.begin()+rn);
-                        result=std::to_string(ms)+"|"+retOrder.id+"|c";
+                        result=std::to_string(ms)+"|"+retOrder.id.str()+"|c";
                         break;}
                 }
                 break;
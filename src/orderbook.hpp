@@ -17,6 +17,7 @@
 #pragma once
 
 #include <marketlevel2data.hpp>
+#include <fixedstring.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -25,16 +26,25 @@
 #include <ostream>
 #include <algorithm>
 #include <iterator>
+#include <map>
+#include <utility>
+#include <functional>
+
+/* ids and tickers of the live orders are stored inline: an Order is 48 bytes and never touches the heap.
+ * Messages whose id or ticker do not fit are dropped by OrderBook::processOrder.
+ */
+typedef FixedString<23> OrderId;
+typedef FixedString<11> Ticker;
 
 struct Order{
-    std::string id;
-    std::string ticker;
     double price_{0.};
     std::uint32_t size_{0};
+    OrderId id;
+    Ticker ticker;
 
     Order() = default;
-    Order(const std::string &id, const std::string &ticker, double price, uint32_t size) : id(id), ticker(ticker),
-                                                                                           price_(price), size_(size) {}
+    Order(std::string_view id, std::string_view ticker, double price, uint32_t size) : price_(price), size_(size),
+                                                                                       id(id), ticker(ticker) {}
 
     friend std::ostream &operator<<(std::ostream &os, const Order &order) {
         os << "id: " << order.id << " ticker: " << order.ticker << " price_: " << order.price_ << " size_: "
@@ -50,30 +60,38 @@ struct tickerTag{};
 struct priceTag{};
 struct tickerPriceTag{};
 
-/* Define a multi_index_container of Order with following indices:
- *   - a unique index sorted by Order::id,
+/* The indices an OrderSet can be built with:
+ *   - a unique index sorted by Order::id (needed by OrderBook),
+ *   - a non-unique index sorted by Order::ticker and Order::price_ (needed by OrderBook),
  *   - a non-unique index sorted by Order::ticker,
  *   - a non-unique index sorted by Order::price_.
  *   size_ doesn't need to be indexed, as is at most removed/updated via Order::id handler
  */
+namespace orderindex {
+    typedef boost::multi_index::ordered_unique<
+            boost::multi_index::tag<idTag>, BOOST_MULTI_INDEX_MEMBER(Order,OrderId,id)> byId;
+    typedef boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<tickerPriceTag>, boost::multi_index::composite_key<Order,
+                    BOOST_MULTI_INDEX_MEMBER(Order,Ticker,ticker),
+                    BOOST_MULTI_INDEX_MEMBER(Order,double,price_)>
+    > byTickerPrice;
+    typedef boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<tickerTag>, BOOST_MULTI_INDEX_MEMBER(Order,Ticker,ticker)> byTicker;
+    typedef boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<priceTag>, BOOST_MULTI_INDEX_MEMBER(Order,double,price_)> byPrice;
+}
 
-
-typedef boost::multi_index::multi_index_container<
+/* Every index costs three pointers per live order and an O(log(n)) update per add/cancel:
+ * a deployment only pays for the extra indices it asks for. id must stay the first index.
+ */
+template<typename... ExtraIndices>
+using OrderSetWith = boost::multi_index::multi_index_container<
         Order,
-        boost::multi_index::indexed_by<
-                boost::multi_index::ordered_unique<
-                        boost::multi_index::tag<idTag>, BOOST_MULTI_INDEX_MEMBER(Order,std::string,id)>,
-                boost::multi_index::ordered_non_unique<
-                        boost::multi_index::tag<tickerTag>, BOOST_MULTI_INDEX_MEMBER(Order,std::string,ticker)>,
-                boost::multi_index::ordered_non_unique<
-                        boost::multi_index::tag<priceTag>, BOOST_MULTI_INDEX_MEMBER(Order,double,price_)>,
-                boost::multi_index::ordered_non_unique<
-                        boost::multi_index::tag<tickerPriceTag>, boost::multi_index::composite_key<Order,
-                                BOOST_MULTI_INDEX_MEMBER(Order,std::string,ticker),
-                                BOOST_MULTI_INDEX_MEMBER(Order,double,price_)>
-                                >
-        >
-> OrderSet;
+        boost::multi_index::indexed_by<orderindex::byId, orderindex::byTickerPrice, ExtraIndices...>
+>;
+
+typedef OrderSetWith<> OrderSet; // what OrderBook needs
+typedef OrderSetWith<orderindex::byTicker, orderindex::byPrice> FullOrderSet;
 
 template<typename MultiIndexContainer, typename Tag>
 auto getOrdersInContainerByTag(const MultiIndexContainer& s)
@@ -83,14 +101,16 @@ auto getOrdersInContainerByTag(const MultiIndexContainer& s)
     return std::pair{i.begin(),i.end()};
 }
 
-double getMinPriceForTickerIn(std::string const& ticker, OrderSet const& o){
-    auto range = o.get<tickerPriceTag>().equal_range(ticker);
+template<typename Set>
+double getMinPriceForTickerIn(Ticker const& ticker, Set const& o){
+    auto range = boost::multi_index::get<tickerPriceTag>(o).equal_range(ticker);
     if (boost::empty(range))return 0.;
     return(boost::begin(boost::make_iterator_range(range)))->price_;
 }
 
-double getMaxPriceForTickerIn(std::string const& ticker, OrderSet const& o){
-    auto range = o.get<tickerPriceTag>().equal_range(ticker);
+template<typename Set>
+double getMaxPriceForTickerIn(Ticker const& ticker, Set const& o){
+    auto range = boost::multi_index::get<tickerPriceTag>(o).equal_range(ticker);
     if (boost::empty(range))return 0.;
     return(boost::rbegin(boost::make_iterator_range(range)))->price_;
 }
@@ -104,79 +124,257 @@ private:
     std::uint32_t new_size_{0};
 };
 
-class OrderBook{
+/* plain (non-atomic) counters owned by the thread driving OrderBook::processOrder.
+ * Readers must not access them directly: see metrics.hpp for the snapshot mechanism.
+ */
+struct OrderCounters{
+    std::uint64_t add{0};
+    std::uint64_t update{0};
+    std::uint64_t cancel{0};
+    std::uint64_t dropped{0}; // messages discarded by processOrder: non-processable, or updating/cancelling an unknown id
+};
+
+struct TickerSize{
+    std::size_t ask{0};
+    std::size_t bid{0};
+};
+
+/* best price of one side of a ticker and the total size resting at that price. price 0 when the side is empty */
+struct TopOfBook{
+    double price{0.};
+    std::uint64_t size{0};
+};
+
+typedef std::function<void(Ticker const&, MarketData::Side, TopOfBook const&)> TopOfBookListener;
+
+/* memory used by the live orders, as seen by the allocator (its own bookkeeping is not included) */
+struct BookFootprint{
+    std::size_t live_orders{0};
+    std::size_t bytes_per_order{0}; // one container node: the Order plus the links of every index
+    std::size_t total_bytes{0}; // the book itself, the nodes of the live orders, the two container headers and the price levels
+};
+
+/* Counting=false compiles the OrderCounters increments out, to measure what they cost */
+template<typename Set, bool Counting = true>
+class BasicOrderBook{
 private:
-    OrderSet ask, bid;
+    Set ask, bid;
+    OrderCounters counters_;
+    TopOfBookListener listener_;
+    // total size resting at each (ticker, price) of a side, only kept while a listener is registered
+    typedef std::map<std::pair<Ticker, double>, std::uint64_t> Levels;
+    Levels ask_levels_, bid_levels_;
+
+    static void count(std::uint64_t &counter){
+        if constexpr (Counting) counter++;
+    }
+
+    Levels &levelsOf(MarketData::Side side){ return side == MarketData::Side::ask ? ask_levels_ : bid_levels_; }
+
+    // O(log(levels)): the sizes are never 0, so a level totalling 0 is empty
+    void addToLevel(MarketData::Side side, Order const& o, std::int64_t delta){
+        auto &levels = levelsOf(side);
+        auto &total = levels[{o.ticker, o.price_}];
+        total += delta;
+        if (total == 0) levels.erase({o.ticker, o.price_});
+    }
+
+    [[nodiscard]] bool isAtTop(Order const& o, MarketData::Side side) const {
+        return o.price_ == (side == MarketData::Side::ask ? getMinPriceForTickerIn(o.ticker, ask)
+                                                          : getMaxPriceForTickerIn(o.ticker, bid));
+    }
+
+    void notifyIfAtTop(Order const& o, MarketData::Side side){
+        if (isAtTop(o, side)) listener_(o.ticker, side, getTopOfBook(o.ticker, side));
+    }
+
+    template<typename Iterator>
+    void eraseAndNotify(Set &target, Iterator iter, MarketData::Side side){
+        if (!listener_) {
+            target.erase(iter);
+            return;
+        }
+        bool at_top{isAtTop(*iter, side)};
+        Ticker ticker{iter->ticker};
+        addToLevel(side, *iter, -static_cast<std::int64_t>(iter->size_));
+        target.erase(iter);
+        if (at_top) listener_(ticker, side, getTopOfBook(ticker, side));
+    }
 
-    void add(boost::shared_ptr<MarketData> const& md){ // O(log(n))
-        OrderSet *target{nullptr};
-        target = (md->getSide()==MarketData::Side::ask)?&ask:&bid;
-        target->insert({md->getOrderId(), md->getTicker(), md->getPrice(), md->getSize()});
+    void add(MarketData const& md){ // O(log(n))
+        Set *target{nullptr};
+        target = (md.getSide()==MarketData::Side::ask)?&ask:&bid;
+        auto inserted = target->insert({md.getOrderId(), md.getTicker(), md.getPrice(), md.getSize()});
+        if (listener_ && inserted.second) {
+            addToLevel(md.getSide(), *inserted.first, inserted.first->size_);
+            notifyIfAtTop(*inserted.first, md.getSide());
+        }
     };
 
-    void update(boost::shared_ptr<MarketData> const& md){ // O(1)
-        auto &id_index = ask.get<0>();
-        auto iter = id_index.find(md->getOrderId());
+    // false if the id is not in the book (e.g. its add was dropped)
+    bool update(MarketData const& md){ // O(1)
+        OrderId id{md.getOrderId()};
+        auto &id_index = ask.template get<0>();
+        auto iter = id_index.find(id);
         if(iter==ask.end()){ // not in ask!;
-            auto &bid_id_index = bid.get<0>();
-            iter = bid_id_index.find(md->getOrderId());
-            bid.modify(iter, UpdateSize(md->getSize()));
-            return;
+            auto &bid_id_index = bid.template get<0>();
+            iter = bid_id_index.find(id);
+            if (iter == bid_id_index.end()) return false;
+            std::int64_t old_size{iter->size_};
+            bid.modify(iter, UpdateSize(md.getSize()));
+            if (listener_) {
+                addToLevel(MarketData::Side::bid, *iter, iter->size_ - old_size);
+                notifyIfAtTop(*iter, MarketData::Side::bid);
+            }
+            return true;
+        }
+        std::int64_t old_size{iter->size_};
+        ask.modify(iter, UpdateSize(md.getSize()));
+        if (listener_) {
+            addToLevel(MarketData::Side::ask, *iter, iter->size_ - old_size);
+            notifyIfAtTop(*iter, MarketData::Side::ask);
         }
-        ask.modify(iter, UpdateSize(md->getSize()));
+        return true;
     };
 
-    void cancel(boost::shared_ptr<MarketData> const& md){ // O(1)
-        auto &id_index = ask.get<0>();
-        auto iter = id_index.find(md->getOrderId());
+    // false if the id is not in the book (e.g. its add was dropped)
+    bool cancel(MarketData const& md){ // O(1)
+        OrderId id{md.getOrderId()};
+        auto &id_index = ask.template get<0>();
+        auto iter = id_index.find(id);
         if (iter==ask.end()){ // not in ask
-            auto &bid_id_index = bid.get<0>();
-            iter = bid_id_index.find(md->getOrderId());
-            bid.erase(iter);
-            return;
+            auto &bid_id_index = bid.template get<0>();
+            iter = bid_id_index.find(id);
+            if (iter == bid_id_index.end()) return false;
+            eraseAndNotify(bid, iter, MarketData::Side::bid);
+            return true;
         }
-        ask.erase(iter);
+        eraseAndNotify(ask, iter, MarketData::Side::ask);
+        return true;
     };
 
 public:
     bool empty(){ return (ask.empty()&&bid.empty());}
-    void processOrder(boost::shared_ptr<MarketData> const& md){
-        if(!md->isProcessable())return; // discard corrupted order
-        switch (md->getAction()) {
+    void processOrder(boost::shared_ptr<MarketData> const& md){ processOrder(*md); }
+    void processOrder(MarketData const& md){
+        if(!md.isProcessable() || !OrderId::fits(md.getOrderId()) || !Ticker::fits(md.getTicker())){
+            count(counters_.dropped); // discard corrupted order
+            return;
+        }
+        switch (md.getAction()) {
             case MarketData::Action::add:
+                count(counters_.add);
                 add(md);
                 break;
             case MarketData::Action::update:
-                update(md);
+                count(update(md) ? counters_.update : counters_.dropped); // unknown id: dropped
                 break;
             case MarketData::Action::cancel:
-                cancel(md);
+                count(cancel(md) ? counters_.cancel : counters_.dropped); // unknown id: dropped
                 break;
         }
     }
 
     boost::tuple<double, double> getBestAskAndBid(std::string const& ticker) {
-        return {getMinPriceForTickerIn(ticker, ask), getMaxPriceForTickerIn(ticker, bid)};
+        if (!Ticker::fits(ticker)) return {0., 0.}; // can't be in the book
+        Ticker key{ticker};
+        return {getMinPriceForTickerIn(key, ask), getMaxPriceForTickerIn(key, bid)};
     }
 
-    // some utility interface, for testing
-    double getPriceFor(std::string const& id) {
-        OrderSet *target = &ask;
-        auto &id_index = target->get<0>();
-        auto iter = id_index.find(id);
-        if (iter == target->end()) { // not in ask!
-            target = &bid;
+    /**
+     * register the callback invoked (from the thread driving processOrder) every time an order changes
+     * the best price or the size at the best price of a ticker. One listener per book, an empty one disables
+     * the notifications (and their cost).
+     * While a listener is registered the book keeps the total size of every price level, so that a notification
+     * costs O(log(n)) on top of the message; registering one walks the live orders once, O(n).
+     */
+    void onTopOfBook(TopOfBookListener listener){
+        listener_ = std::move(listener);
+        ask_levels_.clear();
+        bid_levels_.clear();
+        if (!listener_) return;
+        for (const auto &o : ask) addToLevel(MarketData::Side::ask, o, o.size_);
+        for (const auto &o : bid) addToLevel(MarketData::Side::bid, o, o.size_);
+    }
+
+    // O(log(n)) with a listener registered (see onTopOfBook), O(log(n) + orders at the best price) otherwise
+    [[nodiscard]] TopOfBook getTopOfBook(Ticker const& ticker, MarketData::Side side) const {
+        TopOfBook result;
+        result.price = (side == MarketData::Side::ask) ? getMinPriceForTickerIn(ticker, ask)
+                                                       : getMaxPriceForTickerIn(ticker, bid);
+        if (result.price == 0.) return result;
+        if (listener_) {
+            const auto &levels = side == MarketData::Side::ask ? ask_levels_ : bid_levels_;
+            auto level = levels.find({ticker, result.price});
+            if (level != levels.end()) result.size = level->second;
+            return result;
         }
-        return getOrdersInContainerByTag<OrderSet,idTag>(*target).first->price_;
+        auto &index = (side == MarketData::Side::ask ? ask : bid).template get<tickerPriceTag>();
+        for (const auto &o : boost::make_iterator_range(index.equal_range(boost::make_tuple(ticker, result.price))))
+            result.size += o.size_;
+        return result;
     }
 
-    std::uint32_t getSizeFor(std::string const& id){
-        OrderSet *target = &ask;
-        auto &id_index = target->get<0>();
-        auto iter = id_index.find(id);
-        if (iter == target->end()) { // not in ask!
-            target = &bid;
+    // metrics interface: only call from the thread driving processOrder (see metrics.hpp)
+    [[nodiscard]] const OrderCounters &getCounters() const { return counters_; }
+    [[nodiscard]] std::size_t askSize() const { return ask.size(); }
+    [[nodiscard]] std::size_t bidSize() const { return bid.size(); }
+
+    /**
+     * walks the ticker_and_price index of both sides: orders come sorted by ticker, so every ticker
+     * is looked up in the result once. O(n) in the number of live orders: meant for periodic reporting,
+     * not for the hot path.
+     * @return number of live ask/bid orders for every ticker in the book
+     */
+    [[nodiscard]] std::map<std::string, TickerSize> getTickerSizes() const {
+        std::map<std::string, TickerSize> result;
+        auto &ask_index = ask.template get<tickerPriceTag>();
+        for (auto it = ask_index.begin(); it != ask_index.end();) {
+            auto next = ask_index.upper_bound(it->ticker);
+            result[it->ticker.str()].ask = std::distance(it, next);
+            it = next;
+        }
+        auto &bid_index = bid.template get<tickerPriceTag>();
+        for (auto it = bid_index.begin(); it != bid_index.end();) {
+            auto next = bid_index.upper_bound(it->ticker);
+            result[it->ticker.str()].bid = std::distance(it, next);
+            it = next;
         }
-        return getOrdersInContainerByTag<OrderSet,idTag>(*target).first->size_;
+        return result;
+    }
+
+    // O(1): the node sizes are known at compile time
+    [[nodiscard]] BookFootprint getFootprint() const {
+        constexpr std::size_t node_size{sizeof(typename Set::final_node_type)};
+        // a red-black tree node: the value plus the color, parent, left and right links
+        constexpr std::size_t level_node_size{sizeof(typename Levels::value_type) + 4 * sizeof(void *)};
+        std::size_t live_orders{ask.size() + bid.size()};
+        std::size_t levels{ask_levels_.size() + bid_levels_.size()};
+        return {live_orders, node_size, sizeof(*this) + (live_orders + 2) * node_size + levels * level_node_size};
+    }
+
+    // some utility interface, for testing. 0 when the id is not in the book
+    double getPriceFor(std::string const& id) const {
+        auto order = findOrder(id);
+        return order ? order->price_ : 0.;
+    }
+
+    std::uint32_t getSizeFor(std::string const& id) const {
+        auto order = findOrder(id);
+        return order ? order->size_ : 0;
+    }
+
+private:
+    [[nodiscard]] const Order *findOrder(std::string const& id) const {
+        if (!OrderId::fits(id)) return nullptr; // can't be in the book
+        OrderId key{id};
+        for (const Set *target : {&ask, &bid}) {
+            auto &id_index = target->template get<0>();
+            auto iter = id_index.find(key);
+            if (iter != id_index.end()) return &*iter;
+        }
+        return nullptr;
     }
     };
+
+typedef BasicOrderBook<OrderSet> OrderBook;
@@ -0,0 +1,341 @@
+//A small runtime for pipelines of pinned threads connected by bounded queues.
+//Copyright (C) 2023,  Eric Mandolesi
+
+//This program is free software; you can redistribute it and/or
+//modify it under the terms of the GNU General Public License
+//as published by the Free Software Foundation; either version 2
+//of the License, or (at your option) any later version.
+
+//This program is distributed in the hope that it will be useful,
+//but WITHOUT ANY WARRANTY; without even the implied warranty of
+//MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//GNU General Public License for more details.
+
+//You should have received a copy of the GNU General Public License
+//along with this program; if not, write to the Free Software
+//Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
+
+/* Single producer, single consumer ring buffer. The capacity is rounded up to a power of two.
+ * head_ and tail_ live on their own cache lines so that producer and consumer don't share one.
+ */
+template<typename T>
+class BoundedQueue{
+public:
+    explicit BoundedQueue(std::size_t capacity){
+        std::size_t c{1};
+        while (c < capacity) c <<= 1;
+        slots_.resize(c);
+        mask_ = c - 1;
+    }
+
+    // producer side: false (and value untouched) when the queue is full
+    bool tryPush(T &&value){
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size()) return false;
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side: false when the queue is empty
+    bool tryPop(T &value){
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // approximate when called from a third thread. head_ is loaded first: it never passes the tail loaded after it
+    [[nodiscard]] std::size_t size() const {
+        auto head = head_.load(std::memory_order_acquire);
+        auto tail = tail_.load(std::memory_order_acquire);
+        return std::min(tail - head, slots_.size());
+    }
+    [[nodiscard]] bool empty() const { return size() == 0; }
+    [[nodiscard]] std::size_t capacity() const { return slots_.size(); }
+
+private:
+    std::vector<T> slots_;
+    std::size_t mask_{0};
+    alignas(64) std::atomic<std::size_t> head_{0}; // next slot to pop
+    alignas(64) std::atomic<std::size_t> tail_{0}; // next slot to push
+};
+
+/* What a stage does when its last step found nothing to do */
+struct IdleStrategy{
+    enum class Kind{spin, yield, sleep};
+    Kind kind{Kind::sleep};
+    std::chrono::microseconds sleep_for{100};
+
+    void idle() const {
+        switch (kind) {
+            case Kind::spin:
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+                break;
+            case Kind::yield:
+                std::this_thread::yield();
+                break;
+            case Kind::sleep:
+                std::this_thread::sleep_for(sleep_for);
+                break;
+        }
+    }
+
+    /**
+     * parse "spin", "yield" or "sleep[:microseconds]"
+     * @throws std::invalid_argument on anything else
+     */
+    static IdleStrategy fromStr(std::string const& s){
+        IdleStrategy result;
+        if (s == "spin") result.kind = Kind::spin;
+        else if (s == "yield") result.kind = Kind::yield;
+        else if (s.rfind("sleep", 0) == 0) {
+            result.kind = Kind::sleep;
+            if (s.size() > 5) {
+                if (s[5] != ':') throw std::invalid_argument("unknown idle strategy: " + s);
+                result.sleep_for = std::chrono::microseconds(std::stoul(s.substr(6)));
+            }
+        }
+        else throw std::invalid_argument("unknown idle strategy: " + s);
+        return result;
+    }
+};
+
+/* A stage is a step function run in a loop by its own thread, optionally pinned to a cpu.
+ * The step returns true when it did some work, false when it found nothing to do (then the stage idles).
+ * A step should handle its own errors: an exception escaping it ends the stage (the other ones keep running)
+ * and is rethrown by Pipeline::stop().
+ * A stage that can't be pinned to the cpu it asked for makes Pipeline::start() throw.
+ */
+struct StageConfig{
+    std::string name;
+    int cpu{-1}; // -1: not pinned
+    IdleStrategy idle;
+};
+
+struct StageStats{
+    std::string name;
+    int cpu{-1};
+    bool pinned{false};
+    bool failed{false}; // the stage ended on an exception
+    std::uint64_t work_steps{0};
+    double seconds{0.};
+    double utilization{0.}; // fraction of the wall time not spent idling
+};
+
+class Pipeline{
+public:
+    Pipeline() = default;
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+    ~Pipeline(){ join(); } // an error of a stage can only be reported by stop()
+
+    // stages can only be added before start()
+    void addStage(StageConfig config, std::function<bool()> step){
+        if (running_) throw std::logic_error("Pipeline: can't add a stage to a running pipeline");
+        stages_.push_back(std::make_unique<Stage>(std::move(config), std::move(step)));
+    }
+
+    /**
+     * start a thread per stage and pin it. The steps only begin once every stage is pinned.
+     * @throws std::runtime_error if a stage can't be pinned to its cpu (the pipeline is stopped)
+     */
+    void start(){
+        if (running_) return;
+        stop_.store(false, std::memory_order_relaxed);
+        go_.store(false, std::memory_order_relaxed);
+        running_ = true;
+        for (auto &stage : stages_) {
+            stage->ready.store(false, std::memory_order_relaxed);
+            stage->thread = std::thread([this, s = stage.get()]{ run(*s); });
+        }
+        for (auto &stage : stages_) {
+            while (!stage->ready.load(std::memory_order_acquire)) std::this_thread::yield();
+        }
+        for (auto &stage : stages_) {
+            if (stage->failed.load(std::memory_order_acquire)) stop(); // rethrows the pinning error
+        }
+        go_.store(true, std::memory_order_release);
+    }
+
+    // true if the calling process may run on cpu
+    static bool cpuAvailable(int cpu){
+        if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &set) != 0) return false;
+        return CPU_ISSET(cpu, &set);
+    }
+
+    /**
+     * ask every stage to leave its loop after the current step and wait for all of them.
+     * @throws the exception that ended a stage, if any (the first stage in declaration order)
+     */
+    void stop(){
+        join();
+        for (auto &stage : stages_) {
+            if (stage->error) std::rethrow_exception(std::exchange(stage->error, nullptr));
+        }
+    }
+
+    [[nodiscard]] bool running() const { return running_; }
+
+    // safe to call while running, from any thread
+    [[nodiscard]] std::vector<StageStats> stats() const {
+        std::vector<StageStats> result;
+        for (const auto &stage : stages_) {
+            StageStats s;
+            s.name = stage->config.name;
+            s.cpu = stage->config.cpu;
+            s.pinned = stage->pinned.load(std::memory_order_relaxed);
+            s.failed = stage->failed.load(std::memory_order_acquire);
+            s.work_steps = stage->work_steps.load(std::memory_order_relaxed);
+            auto started = stage->started_ns.load(std::memory_order_acquire);
+            auto stopped = stage->stopped_ns.load(std::memory_order_acquire);
+            if (started != 0) {
+                auto end = stopped != 0 ? stopped : now();
+                double elapsed = static_cast<double>(end - started);
+                s.seconds = elapsed / 1.e9;
+                if (elapsed > 0)
+                    s.utilization = 1. - static_cast<double>(stage->idle_ns.load(std::memory_order_relaxed)) / elapsed;
+            }
+            result.push_back(s);
+        }
+        return result;
+    }
+
+private:
+    struct Stage{
+        Stage(StageConfig c, std::function<bool()> s) : config(std::move(c)), step(std::move(s)) {}
+        StageConfig config;
+        std::function<bool()> step;
+        std::thread thread;
+        // written by the stage thread only
+        std::atomic<bool> ready{false}; // pinned (or failed to) and waiting for the go
+        std::atomic<bool> pinned{false};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error; // set before failed, read after the join
+        std::atomic<std::uint64_t> work_steps{0};
+        std::atomic<std::uint64_t> idle_ns{0};
+        std::atomic<std::uint64_t> started_ns{0};
+        std::atomic<std::uint64_t> stopped_ns{0};
+    };
+
+    static std::uint64_t now(){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>
+                (std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool pinCurrentThread(int cpu){
+        if (cpu < 0) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+    }
+
+    /* the stage loop: the clock is only read around idle periods, a busy stage pays one relaxed store per step.
+     * An idle period runs from the end of the first step finding nothing to do to the start of the next productive
+     * step: the unproductive steps in between (all of them, when spinning) count as idle.
+     */
+    void run(Stage &stage){
+        bool pinned{pinCurrentThread(stage.config.cpu)};
+        stage.pinned.store(pinned, std::memory_order_relaxed);
+        if (stage.config.cpu >= 0 && !pinned) {
+            stage.error = std::make_exception_ptr(std::runtime_error(
+                    "Pipeline: can't pin stage " + stage.config.name + " to cpu " + std::to_string(stage.config.cpu)));
+            stage.failed.store(true, std::memory_order_release);
+            stage.ready.store(true, std::memory_order_release);
+            return;
+        }
+        stage.ready.store(true, std::memory_order_release);
+        while (!go_.load(std::memory_order_acquire)) {
+            if (stop_.load(std::memory_order_relaxed)) return;
+            std::this_thread::yield();
+        }
+
+        std::uint64_t work_steps{0}, idle_ns{0};
+        std::uint64_t idle_start{0}, idle_end{0};
+        bool idling{false};
+        stage.started_ns.store(now(), std::memory_order_release);
+        while (!stop_.load(std::memory_order_relaxed)) {
+            bool worked;
+            try {
+                worked = stage.step();
+            } catch (...) {
+                stage.error = std::current_exception();
+                stage.failed.store(true, std::memory_order_release);
+                break;
+            }
+            if (worked) {
+                if (idling) { // the idle period ended where this step began
+                    idle_ns += idle_end - idle_start;
+                    idling = false;
+                }
+                stage.work_steps.store(++work_steps, std::memory_order_relaxed);
+                continue;
+            }
+            if (!idling) {
+                idle_start = now();
+                idling = true;
+            }
+            stage.config.idle.idle();
+            idle_end = now();
+            stage.idle_ns.store(idle_ns + (idle_end - idle_start), std::memory_order_relaxed);
+        }
+        if (idling) idle_ns += now() - idle_start;
+        stage.idle_ns.store(idle_ns, std::memory_order_relaxed);
+        stage.stopped_ns.store(now(), std::memory_order_release);
+    }
+
+    void join(){
+        if (!running_) return;
+        stop_.store(true, std::memory_order_relaxed);
+        for (auto &stage : stages_) stage->thread.join();
+        running_ = false;
+    }
+
+    std::vector<std::unique_ptr<Stage>> stages_;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> go_{false};
+    bool running_{false};
+};
+
+inline std::ostream &operator<<(std::ostream &os, const std::vector<StageStats> &stats){
+    for (const auto &s : stats) {
+        os << s.name << ": cpu " << (s.pinned ? std::to_string(s.cpu) : std::string("any"))
+           << " steps " << s.work_steps << " utilization " << 100. * s.utilization << "%"
+           << (s.failed ? " FAILED" : "") << "\n";
+    }
+    return os;
+}
+
+/* Write the stage statistics in the Prometheus text exposition format */
+inline std::ostream &writePrometheus(std::ostream &os, const std::vector<StageStats> &stats){
+    os << "# TYPE mop_stage_steps_total counter\n";
+    for (const auto &s : stats) os << "mop_stage_steps_total{stage=\"" << s.name << "\"} " << s.work_steps << "\n";
+    os << "# TYPE mop_stage_utilization gauge\n";
+    for (const auto &s : stats) os << "mop_stage_utilization{stage=\"" << s.name << "\"} " << s.utilization << "\n";
+    os << "# TYPE mop_stage_failed gauge\n";
+    for (const auto &s : stats) os << "mop_stage_failed{stage=\"" << s.name << "\"} " << s.failed << "\n";
+    return os;
+}